@@ -0,0 +1,288 @@
+// Shell-overhead regression benchmarks. Drives a fero binary in script
+// mode and through a pty, and measures the rest in-process, printing one
+// CSV row per result:
+//
+//   make bench                      # builds main and this, runs both
+//   ./bench_harness [fero] [--quick]
+//   ./bench_harness --startup fero...  # startup time of each binary only
+//
+// Columns are benchmark,param,value,unit. Rates are higher-is-better;
+// latencies are medians and 99th percentiles over the samples taken.
+#define FERO_NO_MAIN
+#include "../main.cpp"
+
+#include <pty.h>
+
+#include <chrono>
+
+using bench_clock = chrono::steady_clock;
+
+string fero_bin = "./main";
+string bench_dir;
+bool quick = false;
+
+void report(const string &bench, const string &param, double value,
+            const string &unit) {
+  cout << bench << ',' << param << ',' << value << ',' << unit << '\n';
+  cout.flush();
+}
+
+double seconds_since(bench_clock::time_point start) {
+  return chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+double percentile(vector<double> samples, double p) {
+  if (samples.empty())
+    return 0;
+  sort(samples.begin(), samples.end());
+  size_t i = static_cast<size_t>(p * (samples.size() - 1));
+  return samples[i];
+}
+
+void write_file(const string &path, const string &text) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+  if (fd == -1 || !write_all(fd, text.data(), text.size())) {
+    perror(path.c_str());
+    exit(1);
+  }
+  close(fd);
+}
+
+// Runs a fero binary on a script with its output thrown away; returns the
+// seconds it took.
+double run_script_file(const string &script, const string &bin = fero_bin) {
+  auto start = bench_clock::now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    execl(bin.c_str(), bin.c_str(), script.c_str(), nullptr);
+    perror(bin.c_str());
+    _exit(127);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+    cerr << "bench: " << bin << " failed on " << script << "\n";
+    exit(1);
+  }
+  return seconds_since(start);
+}
+
+// Exec to exit on an empty script: loader, static initialisers and
+// init_vars/init_pwd, which is all a one-shot automation run pays for.
+void bench_startup(const string &bin) {
+  vector<double> samples;
+  int runs = quick ? 200 : 2000;
+  for (int i = 0; i < runs; i++)
+    samples.push_back(run_script_file("/dev/null", bin) * 1e6);
+  string name = bin.substr(bin.rfind('/') + 1);
+  report("startup", name + "_p50", percentile(samples, 0.5), "us");
+  report("startup", name + "_p99", percentile(samples, 0.99), "us");
+}
+
+void bench_spawn() {
+  int count = quick ? 500 : 5000;
+  string script;
+  for (int i = 0; i < count; i++)
+    script += "/bin/true\n";
+  string path = bench_dir + "/spawn.fero";
+  write_file(path, script);
+  report("spawn", "/bin/true", count / run_script_file(path), "cmds_per_sec");
+}
+
+// Parse throughput in-process, as bench_parse measures it, and of whole
+// scripts of builtin-only lines that never reach exec.
+void bench_parse() {
+  const char *const lines[] = {
+      "ls -la /usr/local/bin",
+      "cat access.log | grep -v healthcheck | sort | uniq -c | sort -rn",
+      "git commit -m 'fix the | in the message' 2>> errors.log",
+      "cd .. && ls || echo failed; pwd",
+      "(cd /tmp && make clean) > /dev/null 2>> err.log; { date; uptime; }",
+  };
+  size_t n = sizeof lines / sizeof lines[0];
+  long count = quick ? 200000 : 2000000;
+  Ast ast;
+  auto start = bench_clock::now();
+  for (long i = 0; i < count; i++)
+    parse_line(lines[i % n], ast);
+  report("parse", "in_process", count / seconds_since(start),
+         "lines_per_sec");
+
+  // Distinct lines, so the parse cache doesn't hide the parser.
+  int script_lines = quick ? 20000 : 200000;
+  string script;
+  for (int i = 0; i < script_lines; i++)
+    script += "echo " + to_string(i) + " && pwd || echo failed\n";
+  string path = bench_dir + "/parse.fero";
+  write_file(path, script);
+  report("parse", "script", script_lines / run_script_file(path),
+         "lines_per_sec");
+}
+
+// Completion against a PATH of one directory holding `n` executables:
+// the time to index it and then per Tab lookup.
+void bench_completion(size_t n) {
+  string dir = bench_dir + "/path" + to_string(n);
+  mkdir(dir.c_str(), 0755);
+  char name[32];
+  for (size_t i = 0; i < n; i++) {
+    snprintf(name, sizeof name, "/cmd%07zu", i * 7919 % n);
+    int fd = open((dir + name).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+    close(fd);
+  }
+  set_var("PATH", dir, true);
+  path_index = PathIndex();
+  auto start = bench_clock::now();
+  refresh_path_index();
+  report("completion_index", to_string(n), seconds_since(start) * 1e3, "ms");
+
+  vector<double> samples;
+  size_t found = 0;
+  for (int i = 0; i < 2000; i++) {
+    snprintf(name, sizeof name, "cmd%07zu", i * 104729 % n);
+    string prefix(name, 3 + i % 8);
+    auto t = bench_clock::now();
+    Matches m = get_matches(prefix);
+    samples.push_back(seconds_since(t) * 1e6);
+    found += m.size();
+  }
+  if (found == 0)
+    cerr << "bench: completion found nothing\n";
+  report("completion", to_string(n) + "_p50", percentile(samples, 0.5), "us");
+  report("completion", to_string(n) + "_p99", percentile(samples, 0.99), "us");
+}
+
+// Reads from the pty until `want` has come out, or gives up after a
+// second. Returns whether it came.
+bool read_until(int fd, string &seen, string_view want) {
+  auto start = bench_clock::now();
+  while (seen.find(want) == string::npos) {
+    if (seconds_since(start) > 1)
+      return false;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof buf);
+    if (n <= 0)
+      return false;
+    seen.append(buf, n);
+  }
+  return true;
+}
+
+// Keystroke to render: the time from writing a key to the pty until the
+// line editor has drawn it, with fero running interactively.
+void bench_keystrokes() {
+  int master;
+  pid_t pid = forkpty(&master, nullptr, nullptr, nullptr);
+  if (pid == 0) {
+    // Outside a git tree, so no prompt status arrives mid-measurement.
+    if (chdir(bench_dir.c_str()) != 0)
+      _exit(127);
+    setenv("HISTFILE", (bench_dir + "/history").c_str(), 1);
+    setenv("TERM", "xterm", 1);
+    execl(fero_bin.c_str(), fero_bin.c_str(), nullptr);
+    _exit(127);
+  }
+  if (pid < 0) {
+    perror("forkpty");
+    return;
+  }
+  string seen;
+  if (!read_until(master, seen, PROMPT)) {
+    cerr << "bench: no prompt from " << fero_bin << "\n";
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    return;
+  }
+  // Let the prompt finish drawing and the editor go raw before typing.
+  struct pollfd pfd = {master, POLLIN, 0};
+  char buf[4096];
+  while (poll(&pfd, 1, 200) > 0 && read(master, buf, sizeof buf) > 0)
+    ;
+
+  vector<double> type, erase;
+  int keys = quick ? 200 : 2000;
+  for (int i = 0; i < keys; i++) {
+    // Type a word, then take it back, so the line stays short.
+    bool typing = i % 16 < 8;
+    char key = typing ? 'a' + i % 8 : 127;
+    seen.clear();
+    auto t = bench_clock::now();
+    [[maybe_unused]] ssize_t n = write(master, &key, 1);
+    // A typed key is echoed; a backspace redraws with a clear to the end
+    // of the screen.
+    if (!read_until(master, seen, typing ? string(1, key) : "\033[J"))
+      break;
+    (typing ? type : erase).push_back(seconds_since(t) * 1e6);
+  }
+  const char *quit = "\rexit\r";
+  [[maybe_unused]] ssize_t n = write(master, quit, strlen(quit));
+  waitpid(pid, nullptr, 0);
+  close(master);
+  report("keystroke", "insert_p50", percentile(type, 0.5), "us");
+  report("keystroke", "insert_p99", percentile(type, 0.99), "us");
+  report("keystroke", "backspace_p50", percentile(erase, 0.5), "us");
+  report("keystroke", "backspace_p99", percentile(erase, 0.99), "us");
+}
+
+// Bytes through a three-stage pipeline whose middle is fero's own cat.
+void bench_pipeline() {
+  size_t mib = quick ? 64 : 512;
+  string path = bench_dir + "/pipeline.fero";
+  write_file(path, "head -c " + to_string(mib << 20) +
+                       " /dev/zero | cat | wc -c > /dev/null\n");
+  report("pipeline", "head|cat|wc", mib / run_script_file(path),
+         "mib_per_sec");
+}
+
+int main(int argc, char **argv) {
+  vector<string> startup_bins;
+  bool startup_only = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0)
+      quick = true;
+    else if (strcmp(argv[i], "--startup") == 0)
+      startup_only = true;
+    else
+      startup_bins.push_back(fero_bin = argv[i]);
+  }
+  if (startup_only) {
+    cout << "benchmark,param,value,unit\n";
+    for (auto &bin : startup_bins)
+      bench_startup(bin);
+    return 0;
+  }
+  if (access(fero_bin.c_str(), X_OK) != 0) {
+    cerr << "bench: " << fero_bin << ": not executable; run make first\n";
+    return 1;
+  }
+  // Absolute, as the interactive run starts in the scratch directory.
+  if (char *full = realpath(fero_bin.c_str(), nullptr)) {
+    fero_bin = full;
+    free(full);
+  }
+  char tmpl[] = "/tmp/fero-bench.XXXXXX";
+  if (!mkdtemp(tmpl)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  bench_dir = tmpl;
+  init_vars();
+  init_pwd();
+
+  cout << "benchmark,param,value,unit\n";
+  bench_startup(fero_bin);
+  bench_spawn();
+  bench_parse();
+  for (size_t n : {1000, 10000, 100000})
+    bench_completion(quick ? n / 10 : n);
+  bench_keystrokes();
+  bench_pipeline();
+
+  string cleanup = "rm -rf '" + bench_dir + "'";
+  return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
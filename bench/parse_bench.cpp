@@ -0,0 +1,44 @@
+// Parse throughput: tokenizes and parses a mix of command lines over and
+// over, without running them, and reports lines per second.
+//
+//   make bench_parse && ./bench_parse [count]
+#define FERO_NO_MAIN
+#include "../main.cpp"
+
+#include <chrono>
+
+const char *const sample_lines[] = {
+    "ls -la /usr/local/bin",
+    "echo \"hello world\" > /tmp/out.txt",
+    "cat access.log | grep -v healthcheck | sort | uniq -c | sort -rn",
+    "git commit -m 'fix the | in the message' 2>> errors.log",
+    "make -j8 CC=clang CFLAGS='-O2 -g' >> build.log 2> build.err &",
+    "find . -name '*.cpp' | xargs wc -l",
+    "cd .. && ls || echo failed; pwd",
+    "(cd /tmp && make clean) > /dev/null 2>> err.log; { date; uptime; }",
+    "par -j 4 gzip -9 {} ::: a.txt b.txt c.txt d.txt",
+};
+
+int main(int argc, char **argv) {
+  long count = argc > 1 ? atol(argv[1]) : 2000000;
+  size_t n = sizeof sample_lines / sizeof sample_lines[0];
+  vector<string> lines(sample_lines, sample_lines + n);
+  size_t bytes = 0;
+  for (long i = 0; i < count; i++)
+    bytes += lines[i % n].size();
+
+  Ast ast;
+  size_t commands = 0;
+  auto start = chrono::steady_clock::now();
+  for (long i = 0; i < count; i++) {
+    parse_line(lines[i % n], ast);
+    commands += ast.cmds.size();
+  }
+  chrono::duration<double> secs = chrono::steady_clock::now() - start;
+
+  cout << "lines,commands,seconds,lines_per_sec,mib_per_sec\n";
+  cout << count << ',' << commands << ',' << secs.count() << ','
+       << count / secs.count() << ',' << bytes / secs.count() / (1 << 20)
+       << '\n';
+  return 0;
+}
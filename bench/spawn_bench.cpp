@@ -0,0 +1,37 @@
+// Spawn rate of each exe_extr() backend: starts /bin/true repeatedly and
+// reports commands per second.
+//
+//   make bench_spawn && ./bench_spawn [count] [heap-MiB]
+//
+// The optional heap argument dirties that much memory first, to show how
+// fork's cost grows with the parent's resident size.
+#define FERO_NO_MAIN
+#include "../main.cpp"
+
+#include <chrono>
+
+int main(int argc, char **argv) {
+  int count = argc > 1 ? atoi(argv[1]) : 2000;
+  size_t heap_mib = argc > 2 ? strtoul(argv[2], nullptr, 10) : 0;
+
+  vector<char> heap(heap_mib << 20);
+  for (size_t i = 0; i < heap.size(); i += 4096)
+    heap[i] = 1;
+
+  init_vars();
+  Arena arena;
+  Command cmd;
+  set_args(cmd, arena, {"/bin/true"});
+  cout << "backend,count,heap_mib,seconds,cmds_per_sec\n";
+  for (SpawnBackend backend :
+       {SpawnBackend::PosixSpawn, SpawnBackend::Vfork, SpawnBackend::Fork}) {
+    spawn_backend = backend;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+      exe_extr(cmd);
+    chrono::duration<double> secs = chrono::steady_clock::now() - start;
+    cout << spawn_backend_name(backend) << ',' << count << ',' << heap_mib
+         << ',' << secs.count() << ',' << count / secs.count() << '\n';
+  }
+  return 0;
+}
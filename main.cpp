@@ -1,17 +1,48 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <dirent.h>
 #include <fcntl.h>
-#include <filesystem>
 #include <iostream>
+#include <iterator>
+#include <linux/sched.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
@@ -21,19 +52,288 @@ using namespace std;
 #define GREEN "\033[32m"
 #define PROMPT "\033[32m$ \033[0m"
 #define RED "\033[31m"
+#define MAGENTA "\033[35m"
 
+// Bump allocator for everything parsed from one command line: its words
+// and the argv arrays handed to exec. arena_reset() frees it all at once
+// but keeps the largest block, so parsing the next line normally does not
+// call malloc at all.
+struct Arena {
+  struct Block {
+    unique_ptr<char[]> data;
+    size_t size = 0;
+  };
+  vector<Block> blocks;
+  size_t used = 0; // bytes taken from blocks.back()
+};
+
+void *arena_alloc(Arena &arena, size_t n, size_t align = alignof(char *)) {
+  if (!arena.blocks.empty()) {
+    size_t off = (arena.used + align - 1) & ~(align - 1);
+    if (off + n <= arena.blocks.back().size) {
+      arena.used = off + n;
+      return arena.blocks.back().data.get() + off;
+    }
+  }
+  size_t size = arena.blocks.empty() ? 4096 : arena.blocks.back().size * 2;
+  while (size < n)
+    size *= 2;
+  arena.blocks.push_back({make_unique<char[]>(size), size});
+  arena.used = n;
+  return arena.blocks.back().data.get();
+}
+
+// A NUL-terminated copy of `s`.
+char *arena_copy(Arena &arena, string_view s) {
+  char *p = static_cast<char *>(arena_alloc(arena, s.size() + 1, 1));
+  memcpy(p, s.data(), s.size());
+  p[s.size()] = '\0';
+  return p;
+}
+
+void arena_reset(Arena &arena) {
+  if (arena.blocks.size() > 1)
+    arena.blocks.erase(arena.blocks.begin(), arena.blocks.end() - 1);
+  arena.used = 0;
+}
+
+// A command's words as the argv array exec takes: NUL-terminated strings
+// followed by a null pointer, all in a parse arena.
+struct Args {
+  char **argv = nullptr;
+  size_t argc = 0;
+
+  struct iterator {
+    using iterator_category = forward_iterator_tag;
+    using value_type = string_view;
+    using difference_type = ptrdiff_t;
+    using pointer = const string_view *;
+    using reference = string_view;
+
+    char *const *p;
+    string_view operator*() const { return *p; }
+    iterator &operator++() {
+      ++p;
+      return *this;
+    }
+    iterator operator+(ptrdiff_t n) const { return {p + n}; }
+    bool operator==(const iterator &o) const { return p == o.p; }
+    bool operator!=(const iterator &o) const { return p != o.p; }
+  };
+
+  size_t size() const { return argc; }
+  bool empty() const { return argc == 0; }
+  string_view operator[](size_t i) const { return argv[i]; }
+  iterator begin() const { return {argv}; }
+  iterator end() const { return {argv + argc}; }
+};
+
+// `( list )` runs in a forked copy of the shell, `{ list; }` in this one.
+enum class CommandKind : uint8_t { Simple, Subshell, Group };
+
+// `2>&1` and `1>&2` make one output a copy of the other. Redirections
+// apply left to right, so in `2>&1 > f` stderr copies stdout from before
+// the redirections (the shell's own or the pipe) and in `> f 2>&1` it
+// shares f with stdout.
+enum class DupFrom : uint8_t { None, Original, Target };
+
+// Where stdout or stderr goes: its own file, empty for none, or a copy.
+struct OutputRedirect {
+  string_view file;
+  bool append = false;
+  bool expand = false; // the target has a `$`
+  DupFrom dup = DupFrom::None;
+};
+
+// Redirect targets point into the same arena as the words and are
+// NUL-terminated too.
 struct Command {
-  vector<string> args;
+  CommandKind kind = CommandKind::Simple;
+  uint32_t body = 0; // Subshell/Group: the list inside, a node of the Ast
+  Args args;
+  // Per word: expand_*_flag bits for what it needs, or null when no word
+  // needs anything. The first `assigns` words are NAME=value.
+  const uint8_t *expand = nullptr;
+  uint32_t assigns = 0;
+  // After expand_command(): the NAME=value prefix, null-terminated, or null.
+  char **env = nullptr;
+
+  // `<` names a file in stdin_file; a here-document or a here-string puts
+  // the text itself there, which the shell feeds to the command.
+  bool redirect_stdin = false;
+  string_view stdin_file;
+  bool stdin_text = false;
+  bool expand_stdin = false;
+
+  OutputRedirect stdout_to, stderr_to;
+};
+
+// Sets the words of a command built by the shell itself rather than
+// parsed from a line.
+void set_args(Command &cmd, Arena &arena, const vector<string> &words) {
+  cmd.args.argc = words.size();
+  cmd.args.argv = static_cast<char **>(
+      arena_alloc(arena, (words.size() + 1) * sizeof(char *)));
+  for (size_t i = 0; i < words.size(); i++)
+    cmd.args.argv[i] = arena_copy(arena, words[i]);
+  cmd.args.argv[words.size()] = nullptr;
+}
+
+// A word or operator of the command line. Operators such as `|` are only
+// recognised when unquoted, so `echo '|'` still prints a bar. Words are
+// NUL-terminated views into the parse arena; begin/end are where the token
+// was in the line, quotes included.
+struct Token {
+  string_view text;
+  bool quoted = false;
+  bool op = false;
+  bool glob = false; // has an unquoted *, ? or [ and no quoted one
+  bool vars = false; // has a $ outside single quotes and none inside
+  uint32_t bare = 0;  // length of text before its first quote
+  uint32_t begin = 0, end = 0;
+};
+
+// Pipeline: commands a .. a+b-1 of the Ast joined by `|`.
+// And/Or/Seq: nodes a and b joined by `&&`, `||` or `;`.
+// Async: node a, followed by `&`.
+enum class NodeKind : uint8_t { Pipeline, And, Or, Seq, Async };
+
+struct Node {
+  NodeKind kind = NodeKind::Pipeline;
+  uint32_t a = 0, b = 0;
+  string_view text; // the source, for the job table
+  bool timed = false; // a pipeline prefixed with `time`
+};
 
-  bool redirect_stdout = false;
-  string stdout_file;
-  bool append_stdout = false;
+// A parsed line. Nodes refer to each other and to commands by index, and
+// everything they point at lives in the arena, so a whole Ast can be moved
+// and run any number of times without parsing again.
+struct Ast {
+  vector<Node> nodes;
+  vector<Command> cmds;
+  uint32_t root = 0; // meaningless when nodes is empty
 
-  bool redirect_stderr = false;
-  string stderr_file;
-  bool append_stderr = false;
+  Arena arena;
+  // Scratch space for the parser, kept for its capacity.
+  vector<Token> tokens;
+  vector<string_view> docs;
+  vector<Command> stages;
 };
 
+// One process of a job. Stages that could not be started are recorded as
+// already done, with the status they failed with.
+struct JobProc {
+  pid_t pid = -1;
+  int code = 127;
+  bool done = false;
+  bool stopped = false;
+};
+
+struct Job {
+  int id = 0;
+  pid_t pgid = 0;
+  string text;
+  vector<JobProc> procs;
+  struct rusage usage = {}; // of its processes that have exited
+  bool foreground = false;
+  bool notified = false;  // a background job's "Stopped" was reported
+  struct termios tmodes;  // terminal modes saved when it stopped
+  bool has_tmodes = false;
+};
+
+// Every live job, in order of creation. A foreground job is in here while
+// the shell waits for it, and stays if it is stopped.
+vector<Job> jobs;
+int current_job = 0; // what fg/bg act on by default
+
+// Exit status of the last foreground command.
+int last_status = 0;
+
+// `set -o pipefail`: a pipeline fails when any of its stages fails.
+bool opt_pipefail = false;
+
+// `set -o timing`: after each line, report on stderr how long the shell
+// spent parsing it, running builtins, starting processes (fork to exec)
+// and waiting for them.
+bool opt_timing = false;
+
+struct LineTiming {
+  chrono::nanoseconds parse{0}, builtin{0}, spawn{0}, wait{0};
+  bool cached = false; // the parse was a cache hit
+};
+
+LineTiming line_timing;
+
+// Adds the time until the end of its scope to `total`, when timing is on.
+struct PhaseTimer {
+  chrono::nanoseconds *total;
+  chrono::steady_clock::time_point start;
+
+  explicit PhaseTimer(chrono::nanoseconds &t)
+      : total(opt_timing ? &t : nullptr) {
+    if (total)
+      start = chrono::steady_clock::now();
+  }
+  ~PhaseTimer() {
+    if (total)
+      *total += chrono::steady_clock::now() - start;
+  }
+};
+
+// Always-on counters for the `stats` builtin: each is a plain increment
+// where the thing happens, and only command completion is timed, two clock
+// reads per Tab. Children forked to run shell code count into their own
+// copy, which is lost; the parent counts them as subshells.
+const size_t latency_buckets = 16;
+
+struct Stats {
+  uint64_t builtins = 0;  // run in the shell itself
+  uint64_t externals = 0; // programs started
+  uint64_t subshells = 0; // ( ), and builtins in pipelines
+  uint64_t spawn_failures = 0;
+  // How commands were found: in the hash, in the PATH index, or by
+  // searching PATH because there was no index or it missed.
+  uint64_t hash_hits = 0, index_hits = 0, path_searches = 0;
+  uint64_t completions = 0;
+  // completion_us[i] counts calls that took under 2^i microseconds; the
+  // last bucket counts the rest.
+  uint64_t completion_us[latency_buckets] = {};
+  // Bytes the shell moved itself: builtin output, cat's copies and the
+  // text of here-documents and here-strings.
+  uint64_t sink_bytes = 0, cat_bytes = 0, heredoc_bytes = 0;
+};
+
+Stats stats;
+string stats_file; // $FERO_STATS: where to write them as JSON at exit
+
+// Puts one completion in the histogram when it goes out of scope.
+struct CompletionTimer {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  ~CompletionTimer() {
+    auto us = chrono::duration_cast<chrono::microseconds>(
+                  chrono::steady_clock::now() - start)
+                  .count();
+    size_t bucket = 0;
+    while (bucket + 1 < latency_buckets && us >= int64_t(1) << bucket)
+      bucket++;
+    stats.completions++;
+    stats.completion_us[bucket]++;
+  }
+};
+
+// Resource usage of the foreground jobs that finished since `time` last
+// cleared it, as reported by wait4().
+struct rusage fg_usage = {};
+
+void add_usage(struct rusage &sum, const struct rusage &u) {
+  timeradd(&sum.ru_utime, &u.ru_utime, &sum.ru_utime);
+  timeradd(&sum.ru_stime, &u.ru_stime, &sum.ru_stime);
+  sum.ru_maxrss = max(sum.ru_maxrss, u.ru_maxrss);
+  sum.ru_nvcsw += u.ru_nvcsw;
+  sum.ru_nivcsw += u.ru_nivcsw;
+}
+
 void disableRawMode(struct termios &org_ter) {
   tcsetattr(STDIN_FILENO, TCSANOW, &org_ter);
 }
@@ -46,396 +346,5911 @@ void enableRawMode(struct termios &org_ter) {
   tcsetattr(STDIN_FILENO, TCSANOW, &new_ter);
 }
 
-void apply_redirection(const Command &cmd, int &saved_stdout, int &saved_stderr,
-                       bool &did_redirect_stdout, bool &did_redirect_stderr) {
-  did_redirect_stdout = false;
-  did_redirect_stderr = false;
+// Writes the whole buffer, retrying short writes.
+bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
 
-  if (cmd.redirect_stdout && !cmd.stdout_file.empty()) {
-    saved_stdout = dup(STDOUT_FILENO);
-    int flags = O_WRONLY | O_CREAT | (cmd.append_stdout ? O_APPEND : O_TRUNC);
-    int fd = open(cmd.stdout_file.c_str(), flags, 0644);
-    if (fd == -1) {
-      perror(("open stdout file: " + cmd.stdout_file).c_str());
-    } else {
-      dup2(fd, STDOUT_FILENO);
-      close(fd);
-      did_redirect_stdout = true;
+// True when a zero-copy call failed because this pair of fds (or the
+// kernel) does not support it, as opposed to a real I/O error.
+bool unsupported_errno(int err) {
+  return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP ||
+         err == EBADF;
+}
+
+// Moves everything from `in` to `out` until EOF, letting the kernel move
+// the bytes where it can: copy_file_range between regular files, splice
+// when either end is a pipe, sendfile from a regular file to anything
+// else. Whatever is left goes through a buffered read/write loop. Returns
+// the number of bytes moved, or -1 on error.
+ssize_t transfer_fd(int in, int out) {
+  struct stat in_st, out_st;
+  if (fstat(in, &in_st) != 0 || fstat(out, &out_st) != 0)
+    return -1;
+  bool in_file = S_ISREG(in_st.st_mode), out_file = S_ISREG(out_st.st_mode);
+  bool in_pipe = S_ISFIFO(in_st.st_mode), out_pipe = S_ISFIFO(out_st.st_mode);
+  const size_t chunk = 1 << 20;
+  ssize_t total = 0;
+
+  // Each fast path returns 0 at EOF; a failure before anything moved means
+  // "not supported here", so we drop to the next method.
+  auto drain = [&](auto &&step) -> bool {
+    while (true) {
+      ssize_t n = step();
+      if (n > 0) {
+        total += n;
+        continue;
+      }
+      if (n == 0)
+        return true;
+      if (errno == EINTR)
+        continue;
+      if (total == 0 && unsupported_errno(errno))
+        return false;
+      total = -1;
+      return true;
     }
+  };
+
+  if (in_file && out_file &&
+      drain([&] {
+        return copy_file_range(in, nullptr, out, nullptr, chunk, 0);
+      }))
+    return total;
+  if ((in_pipe || out_pipe) && drain([&] {
+        return splice(in, nullptr, out, nullptr, chunk,
+                      SPLICE_F_MOVE | SPLICE_F_MORE);
+      }))
+    return total;
+  if (in_file && drain([&] { return sendfile(out, in, nullptr, chunk); }))
+    return total;
+
+  static thread_local char buf[1 << 16];
+  while (true) {
+    ssize_t n = read(in, buf, sizeof buf);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      return total;
+    if (!write_all(out, buf, n))
+      return -1;
+    total += n;
   }
+}
 
-  if (cmd.redirect_stderr && !cmd.stderr_file.empty()) {
-    saved_stderr = dup(STDERR_FILENO);
-    int flags = O_WRONLY | O_CREAT | (cmd.append_stderr ? O_APPEND : O_TRUNC);
-    int fd = open(cmd.stderr_file.c_str(), flags, 0644);
-    if (fd == -1) {
-      perror(("open stderr file: " + cmd.stderr_file).c_str());
+// Where a builtin's output goes: the shell's own fd 1 or 2, or a redirect
+// target opened on the first write (or when the builtin is done, so an
+// empty redirect still creates the file). Output is
+// collected and written in large pieces, so builtins never dup2() over
+// the shell's fds and never flush per line. An error sink is paired with
+// the output sink and writes each finished line out at once, after the
+// output before it, so the two stay in order on a terminal.
+struct Sink {
+  int fd = -1;
+  string_view file; // redirect target, NUL-terminated, not yet opened
+  bool append = false;
+  bool owned = false; // fd was opened here
+  bool failed = false;
+  Sink *pair = nullptr;
+  string buf;
+
+  Sink() = default;
+  Sink(const Sink &) = delete;
+  Sink &operator=(const Sink &) = delete;
+  ~Sink();
+};
+
+const size_t sink_buffer = 1 << 16;
+
+// A sink for stdout or stderr as `to` redirects it; a copy of the other
+// one's file is left to the caller, which can pass the same sink twice.
+void sink_init(Sink &s, int std_fd, const OutputRedirect &to) {
+  s.fd = to.dup == DupFrom::Original ? STDOUT_FILENO + STDERR_FILENO - std_fd
+                                     : std_fd;
+  if (!to.file.empty()) {
+    s.fd = -1;
+    s.file = to.file;
+    s.append = to.append;
+  }
+}
+
+// The fd to write to, opening the redirect target the first time; -1 if
+// that failed.
+int sink_fd(Sink &s) {
+  if (s.fd == -1 && !s.failed) {
+    int flags =
+        O_WRONLY | O_CREAT | O_CLOEXEC | (s.append ? O_APPEND : O_TRUNC);
+    s.fd = open(s.file.data(), flags, 0644);
+    if (s.fd == -1) {
+      perror(("cannot open file: " + string(s.file)).c_str());
+      s.failed = true;
     } else {
-      dup2(fd, STDERR_FILENO);
-      close(fd);
-      did_redirect_stderr = true;
+      s.owned = true;
     }
   }
+  return s.fd;
 }
 
-void restore_io(int saved_stdout, int saved_stderr, bool did_redirect_stdout,
-                bool did_redirect_stderr) {
-  if (did_redirect_stdout) {
-    dup2(saved_stdout, STDOUT_FILENO);
-    close(saved_stdout);
-  }
-  if (did_redirect_stderr) {
-    dup2(saved_stderr, STDERR_FILENO);
-    close(saved_stderr);
+void sink_flush(Sink &s) {
+  if (s.buf.empty())
+    return;
+  if (s.pair)
+    sink_flush(*s.pair);
+  int fd = sink_fd(s);
+  if (fd != -1 && !write_all(fd, s.buf.data(), s.buf.size()))
+    s.failed = true;
+  else if (fd != -1)
+    stats.sink_bytes += s.buf.size();
+  s.buf.clear();
+}
+
+void sink_close(Sink &s) {
+  sink_flush(s);
+  if (!s.file.empty())
+    sink_fd(s);
+  if (s.owned)
+    close(s.fd);
+  s.owned = false;
+  s.fd = -1;
+  s.file = {};
+}
+
+Sink::~Sink() { sink_close(*this); }
+
+Sink &operator<<(Sink &s, string_view text) {
+  s.buf += text;
+  if (s.buf.size() >= sink_buffer ||
+      (s.pair && text.find('\n') != string_view::npos))
+    sink_flush(s);
+  return s;
+}
+
+Sink &operator<<(Sink &s, char ch) { return s << string_view(&ch, 1); }
+
+template <class T, class = enable_if_t<is_arithmetic_v<T>>>
+Sink &operator<<(Sink &s, T value) {
+  return s << string_view(to_string(value));
+}
+
+// Shell variables. Exported ones also own a "NAME=value" entry in
+// shell_envp, the environment every exec is given; it is kept up to date
+// one slot at a time as variables change instead of being rebuilt for
+// each spawn. The process's own environ is only read once, at startup.
+struct ShellVar {
+  string value;
+  bool exported = false;
+  string entry;    // NAME=value while exported
+  size_t slot = 0; // and its index in shell_envp
+};
+
+unordered_map<string, ShellVar> shell_vars;
+vector<char *> shell_envp = {nullptr};
+
+void path_var_changed();
+
+void envp_add(ShellVar &var) {
+  var.slot = shell_envp.size() - 1;
+  shell_envp.back() = &var.entry[0];
+  shell_envp.push_back(nullptr);
+}
+
+// Takes the entry out of shell_envp, moving the last one into its slot.
+void envp_remove(ShellVar &var) {
+  size_t last = shell_envp.size() - 2;
+  char *moved = shell_envp[last];
+  shell_envp[var.slot] = moved;
+  shell_envp[last] = nullptr;
+  shell_envp.pop_back();
+  if (moved != &var.entry[0]) {
+    size_t eq = strchr(moved, '=') - moved;
+    shell_vars[string(moved, eq)].slot = var.slot;
   }
+  var.entry.clear();
 }
 
-vector<string> get_matches(const string &prefix) {
-  const char *env_path = getenv("PATH");
-  string path;
-  stringstream ss(env_path ? env_path : "");
-  vector<string> matches;
-  while (getline(ss, path, ':')) {
-    if (filesystem::exists(path)) {
-      for (const auto &entry : filesystem::directory_iterator(path)) {
-        string filename = entry.path().filename().string();
-        if (filename.rfind(prefix, 0) == 0 &&
-            access(entry.path().c_str(), X_OK) == 0)
-          matches.push_back(filename);
-      }
-    }
+bool valid_var_name(string_view name) {
+  if (name.empty() || isdigit(static_cast<unsigned char>(name[0])))
+    return false;
+  return all_of(name.begin(), name.end(), [](char ch) {
+    return isalnum(static_cast<unsigned char>(ch)) || ch == '_';
+  });
+}
+
+const char *get_var(const string &name) {
+  auto it = shell_vars.find(name);
+  return it == shell_vars.end() ? nullptr : it->second.value.c_str();
+}
+
+void var_changed(const string &name) {
+  if (name == "PATH")
+    path_var_changed();
+}
+
+void set_var(const string &name, string_view value, bool export_it = false) {
+  ShellVar &var = shell_vars[name];
+  var.value = value;
+  bool was_exported = var.exported;
+  var.exported = var.exported || export_it;
+  if (var.exported) {
+    var.entry = name + "=" + var.value;
+    if (was_exported)
+      shell_envp[var.slot] = &var.entry[0];
+    else
+      envp_add(var);
   }
-  return matches;
+  var_changed(name);
 }
 
-string lcp_(const vector<string> &strings) {
-  if (strings.empty())
-    return "";
-  string prefix = strings[0];
-  for (size_t i = 1; i < strings.size(); i++) {
-    size_t j = 0;
-    while (j < prefix.size() && j < strings[i].size() &&
-           prefix[j] == strings[i][j]) {
-      j++;
-    }
-    prefix = prefix.substr(0, j);
-    if (prefix.empty())
-      break;
+void export_var(const string &name) {
+  ShellVar &var = shell_vars[name];
+  if (var.exported)
+    return;
+  var.exported = true;
+  var.entry = name + "=" + var.value;
+  envp_add(var);
+  var_changed(name);
+}
+
+void unset_var(const string &name) {
+  auto it = shell_vars.find(name);
+  if (it == shell_vars.end())
+    return;
+  if (it->second.exported)
+    envp_remove(it->second);
+  shell_vars.erase(it);
+  var_changed(name);
+}
+
+// Imports the environment fero was started with, all of it exported.
+void init_vars() {
+  for (char **e = environ; *e; e++) {
+    const char *eq = strchr(*e, '=');
+    if (!eq)
+      continue;
+    string name(*e, eq - *e);
+    ShellVar &var = shell_vars[name];
+    if (var.exported)
+      continue; // only the first of duplicate entries counts, as in getenv
+    var.value = eq + 1;
+    var.exported = true;
+    var.entry = *e;
+    envp_add(var);
   }
-  return prefix;
 }
 
-string read_input() {
-  string input;
-  size_t cursor = 0;
-  struct termios org_ter;
-  enableRawMode(org_ter);
-  while (true) {
-    char ch = getchar();
-    if (ch == '\033') { // Escape sequence for arrow keys
-      char nextch = getchar();
-      if (nextch == '[') {
-        char nextch2 = getchar();
-        switch (nextch2) {
-        case 'C': // right arrow
-          if (cursor < input.size()) {
-            cursor++;
-            cout << "\033[C" << flush;
-          }
-          break;
-        case 'D': // left arrow
-          if (cursor > 0) {
-            cursor--;
-            cout << "\033[D" << flush;
-          }
-          break;
-        default:
-          continue;
-        }
-      }
-    } else if (ch == '\n') {
-      cout << endl;
+// `$NAME`, `${NAME}`, `$?` and `$$` in `word`, replaced by their values;
+// unset variables are empty, and a `$` before anything else stays as it
+// is. There is no field splitting, as in zsh.
+string expand_vars(string_view word) {
+  string out;
+  size_t i = 0;
+  while (i < word.size()) {
+    size_t dollar = word.find('$', i);
+    if (dollar == string_view::npos || dollar + 1 == word.size()) {
+      out += word.substr(i);
       break;
-    } else if (ch == '\t') {
-      if (input.empty())
+    }
+    out += word.substr(i, dollar - i);
+    i = dollar + 1;
+    char next = word[i];
+    if (next == '?' || next == '$') {
+      out += to_string(next == '?' ? last_status : getpid());
+      i++;
+      continue;
+    }
+    size_t end = i;
+    bool braced = next == '{';
+    if (braced) {
+      end = word.find('}', i);
+      if (end == string_view::npos) {
+        out += '$';
         continue;
-      auto matches = get_matches(input);
-      if (!matches.empty()) {
-        if (matches.size() == 1) {
-          input = matches[0] + " ";
-          cursor = input.length();
-          cout << "\r" << PROMPT << input << flush;
-        } else {
-          string lcp = lcp_(matches);
-          if (lcp != input) {
-            input = lcp;
-            cursor = input.length();
-            cout << "\r" << PROMPT << input << flush;
-          } else {
-            for (const auto &match : matches)
-              cout << match << " ";
-            cout << endl << PROMPT << flush;
-          }
-        }
-      }
-    } else if (ch == 127 || ch == 8) { // Backspace
-      if (cursor > 0) {
-        input.erase(input.begin() + cursor - 1);
-        cursor--;
-        cout << "\r" << PROMPT << input << ' ';
-        cout << "\r" << flush;
-        cout << "\033[" << (2 + cursor) << "C" << flush;
-        size_t diff = input.size() - cursor;
-        if (diff > 0)
-          cout << "\033[" << diff << "D" << flush;
-      }
-    } else if (isprint(ch)) {
-      input.insert(input.begin() + cursor, ch);
-      cursor++;
-      cout << "\r" << PROMPT << input;
-      size_t diff = input.size() - cursor;
-      if (diff > 0) {
-        cout << "\033[" << diff << "D" << flush;
       }
+    } else {
+      while (end < word.size() &&
+             (isalnum(static_cast<unsigned char>(word[end])) ||
+              word[end] == '_'))
+        end++;
+    }
+    string name(word.substr(i + braced, end - i - braced));
+    if (!valid_var_name(name)) {
+      out += '$';
+      continue;
     }
+    if (const char *value = get_var(name))
+      out += value;
+    i = end + braced;
   }
-  disableRawMode(org_ter);
-  return input;
+  return out;
 }
 
-Command parse_cmd(const string &input) {
-  vector<string> args;
-  string current;
-  bool in_quotes = false;
-  char quote_char = '\0';
-
-  for (char ch : input) {
-    if (ch == '\'' || ch == '\"') {
-      if (in_quotes && ch == quote_char)
-        in_quotes = false;
-      else if (!in_quotes) {
-        in_quotes = true;
-        quote_char = ch;
-      } else
-        current += ch;
-    } else if (isspace(ch) && !in_quotes) {
-      if (!current.empty()) {
-        args.push_back(current);
-        current.clear();
-      }
-    } else
-      current += ch;
+// shell_envp with a command's own `NAME=value` prefix put over it.
+vector<char *> command_envp(char *const *env) {
+  vector<char *> envp;
+  for (char *const *e = shell_envp.data(); *e; e++) {
+    size_t len = strchr(*e, '=') - *e + 1;
+    bool overridden = false;
+    for (char *const *a = env; *a && !overridden; a++)
+      overridden = strncmp(*a, *e, len) == 0;
+    if (!overridden)
+      envp.push_back(*e);
   }
-  if (!current.empty())
-    args.push_back(current);
+  for (char *const *a = env; *a; a++)
+    envp.push_back(*a);
+  envp.push_back(nullptr);
+  return envp;
+}
 
-  Command cmd;
+// Executables found in one $PATH directory, rescanned only when the
+// directory's mtime changes.
+struct PathDir {
+  string path;
+  bool present = false;
+  struct timespec mtime = {0, 0};
+  vector<string> names;
+};
 
-  for (size_t i = 0; i < args.size(); i++) {
-    if (args[i] == ">" || args[i] == "1>") {
-      if (i + 1 < args.size()) {
-        cmd.stdout_file = args[i + 1];
-        cmd.redirect_stdout = true;
-        cmd.append_stdout = false;
-        i++;
-      }
-    } else if (args[i] == ">>" || args[i] == "1>>") {
-      if (i + 1 < args.size()) {
-        cmd.stdout_file = args[i + 1];
-        cmd.redirect_stdout = true;
-        cmd.append_stdout = true;
-        i++;
-      }
-    } else if (args[i] == "2>") {
-      if (i + 1 < args.size()) {
-        cmd.stderr_file = args[i + 1];
-        cmd.redirect_stderr = true;
-        cmd.append_stderr = false;
-        i++;
-      }
-    } else if (args[i] == "2>>") {
-      if (i + 1 < args.size()) {
-        cmd.stderr_file = args[i + 1];
-        cmd.redirect_stderr = true;
-        cmd.append_stderr = true;
-        i++;
-      }
+// One index of $PATH shared by completion, type/which and command lookup.
+// refresh_path_index() revalidates it once per prompt; everything else only
+// reads memory.
+struct PathIndex {
+  string path_env;
+  vector<PathDir> dirs;
+  unordered_map<string, string> commands; // name -> full path, first hit wins
+  vector<string> sorted;                  // unique names, for prefix search
+  bool built = false;
+};
+
+// A contiguous run of the sorted name table sharing a prefix, plus the
+// longest prefix common to the whole run.
+struct Matches {
+  vector<string>::const_iterator first, last;
+  string_view lcp;
+
+  bool empty() const { return first == last; }
+  size_t size() const { return last - first; }
+};
+
+PathIndex path_index;
+
+// Commands resolved so far, bash `hash`-style: the path to exec and how
+// often it was used. Cleared whenever $PATH changes.
+struct HashedCommand {
+  string path;
+  unsigned hits = 0;
+};
+
+unordered_map<string, HashedCommand> command_hash;
+
+void scan_path_dir(PathDir &dir) {
+  dir.names.clear();
+  DIR *d = opendir(dir.path.c_str());
+  if (!d)
+    return;
+  int dfd = dirfd(d);
+  while (struct dirent *ent = readdir(d)) {
+    const char *name = ent->d_name;
+    if (ent->d_type == DT_DIR || strcmp(name, ".") == 0 ||
+        strcmp(name, "..") == 0)
+      continue;
+    if (faccessat(dfd, name, X_OK, 0) == 0)
+      dir.names.push_back(name);
+  }
+  closedir(d);
+}
+
+// Points `index` at the directories of `path_env`, keeping what is known
+// about the ones it already had.
+void set_path_dirs(PathIndex &index, const string &path_env) {
+  vector<PathDir> dirs;
+  stringstream ss(path_env);
+  string path;
+  while (getline(ss, path, ':')) {
+    if (path.empty())
+      path = ".";
+    auto old = find_if(index.dirs.begin(), index.dirs.end(),
+                       [&](const PathDir &d) { return d.path == path; });
+    if (old != index.dirs.end() && !old->path.empty()) {
+      dirs.push_back(move(*old));
+      old->path.clear();
     } else {
-      cmd.args.push_back(args[i]);
+      PathDir dir;
+      dir.path = path;
+      dirs.push_back(move(dir));
     }
   }
+  index.dirs = move(dirs);
+  index.path_env = path_env;
+}
 
-  return cmd;
+void build_commands(PathIndex &index) {
+  index.commands.clear();
+  for (const auto &dir : index.dirs)
+    for (const auto &name : dir.names)
+      index.commands.emplace(name, dir.path + '/' + name);
+
+  index.sorted.clear();
+  index.sorted.reserve(index.commands.size());
+  for (const auto &entry : index.commands)
+    index.sorted.push_back(entry.first);
+  sort(index.sorted.begin(), index.sorted.end());
+  index.built = true;
 }
 
-bool run_builtin(const Command &cmd) {
-  if (cmd.args.empty())
-    return false;
+// In an interactive shell the index is built on a thread of its own, so
+// the first prompt doesn't wait for it, and kept current with inotify
+// watches on the $PATH directories instead of being revalidated. The main
+// thread only adopts finished indexes, so what it reads never changes
+// under it.
+struct PathWatcher {
+  mutex lock;
+  condition_variable ready_cv;
+  string path_env;               // the $PATH wanted; written by main only
+  unique_ptr<PathIndex> ready;   // newest finished index, not yet adopted
+  int inotify_fd = -1;
+  int wake[2] = {-1, -1};        // a byte means path_env changed
+};
 
-  int saved_stdout = -1, saved_stderr = -1;
-  bool did_redirect_stdout = false, did_redirect_stderr = false;
-  apply_redirection(cmd, saved_stdout, saved_stderr, did_redirect_stdout,
-                    did_redirect_stderr);
+PathWatcher *path_watcher = nullptr;
 
-  auto restore_io_lambda = [&]() {
-    restore_io(saved_stdout, saved_stderr, did_redirect_stdout,
-               did_redirect_stderr);
-  };
+const uint32_t path_watch_events = IN_ONLYDIR | IN_CREATE | IN_DELETE |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                                   IN_DELETE_SELF | IN_MOVE_SELF;
 
-  const char *home = getenv("HOME");
-  const char *env_path = getenv("PATH");
-  const vector<string> builtins = {"echo",  "exit", "pwd",   "cd",  "c",
-                                   "clear", "type", "which", "kill"};
-
-  const string &cmd_name = cmd.args[0];
-
-  if (cmd_name == "exit") {
-    restore_io_lambda();
-    exit(0);
-  } else if (cmd_name == "cd") {
-    string cdpath;
-    if (cmd.args.size() < 2 || cmd.args[1].empty() || cmd.args[1] == "~") {
-      cdpath = home ? string(home) : "/";
-    } else if (cmd.args[1] == ".")
-      cdpath = filesystem::current_path();
-    else if (cmd.args[1] == "..")
-      cdpath = filesystem::current_path().parent_path();
-    else
-      cdpath = filesystem::absolute(cmd.args[1]);
+void post_path_index(PathWatcher *w, const PathIndex &index) {
+  auto ready = make_unique<PathIndex>();
+  ready->path_env = index.path_env;
+  ready->commands = index.commands;
+  ready->sorted = index.sorted;
+  ready->built = true;
+  lock_guard<mutex> guard(w->lock);
+  w->ready = move(ready);
+  w->ready_cv.notify_all();
+}
 
-    if (chdir(cdpath.c_str()) != 0) {
-      perror("cd");
-    }
-    restore_io_lambda();
-    return true;
-  } else if (cmd_name == "c" || cmd_name == "clear") {
-    cout << "\033[2J\033[H" << flush;
-    restore_io_lambda();
-    return true;
-  } else if (cmd_name == "pwd") {
-    cout << filesystem::current_path().string() << endl;
-    restore_io_lambda();
-    return true;
-  } else if (cmd_name == "type" || cmd_name == "which") {
-    if (cmd.args.size() < 2) {
-      cout << "[Usage]: " << cmd_name << " <Command>\n";
-      restore_io_lambda();
-      return true;
+void path_watcher_loop(PathWatcher *w) {
+  PathIndex index;
+  // Watch descriptors by directory; one inode reached by two $PATH entries
+  // has one descriptor.
+  unordered_map<string, int> watches;
+  while (true) {
+    string path_env;
+    {
+      lock_guard<mutex> guard(w->lock);
+      path_env = w->path_env;
     }
-    const string &query = cmd.args[1];
-    if (find(builtins.begin(), builtins.end(), query) != builtins.end()) {
-      cout << GREEN << query << RESET << DGREEN << ": is a shell builtin\n"
-           << RESET;
+    vector<bool> dirty;
+    if (!index.built || path_env != index.path_env) {
+      set_path_dirs(index, path_env);
+      unordered_map<string, int> kept;
+      for (const auto &dir : index.dirs) {
+        auto it = watches.find(dir.path);
+        if (it != watches.end()) {
+          kept.insert(*it);
+          watches.erase(it);
+        } else if (!kept.count(dir.path)) {
+          kept[dir.path] = inotify_add_watch(w->inotify_fd, dir.path.c_str(),
+                                             path_watch_events);
+        }
+      }
+      for (const auto &gone : watches) {
+        bool shared = any_of(kept.begin(), kept.end(), [&](const auto &k) {
+          return k.second == gone.second;
+        });
+        if (gone.second != -1 && !shared)
+          inotify_rm_watch(w->inotify_fd, gone.second);
+      }
+      watches = move(kept);
+      dirty.assign(index.dirs.size(), false);
+      for (size_t i = 0; i < index.dirs.size(); i++)
+        dirty[i] = !index.dirs[i].present;
     } else {
-      stringstream ss(env_path ? env_path : "");
-      string path;
-      bool found = false;
-      while (getline(ss, path, ':')) {
-        string fullpath = path + '/' + query;
-        if (filesystem::exists(fullpath) &&
-            access(fullpath.c_str(), X_OK) == 0) {
-          cout << query << ": is " << fullpath << endl;
-          found = true;
-          break;
+      // Wait for the directories to change, then for the burst of events
+      // (a package install is thousands) to end before rescanning. While
+      // a directory can't be watched, as before it exists, it is retried
+      // every second instead.
+      dirty.assign(index.dirs.size(), false);
+      auto mark = [&](const string &path) {
+        for (size_t i = 0; i < index.dirs.size(); i++)
+          dirty[i] = dirty[i] || index.dirs[i].path == path;
+      };
+      bool unwatched = any_of(watches.begin(), watches.end(),
+                              [](const auto &wd) { return wd.second == -1; });
+      struct pollfd pfd[2] = {{w->inotify_fd, POLLIN, 0},
+                              {w->wake[0], POLLIN, 0}};
+      if (poll(pfd, 2, unwatched ? 1000 : -1) < 0)
+        continue;
+      if (pfd[1].revents & POLLIN) {
+        char buf[64];
+        while (read(w->wake[0], buf, sizeof buf) > 0)
+          ;
+        continue;
+      }
+      alignas(struct inotify_event) char buf[1 << 14];
+      while (pfd[0].revents & POLLIN) {
+        ssize_t n;
+        while ((n = read(w->inotify_fd, buf, sizeof buf)) > 0) {
+          for (ssize_t off = 0; off < n;) {
+            auto *ev = reinterpret_cast<struct inotify_event *>(buf + off);
+            off += sizeof *ev + ev->len;
+            for (auto &[path, wd] : watches) {
+              if (ev->wd != -1 && wd != ev->wd)
+                continue;
+              mark(path);
+              // Deleted, or moved away from the path we want: the watch
+              // is gone or no longer ours, so it goes back to retrying.
+              if (ev->wd == -1)
+                continue;
+              if (ev->mask & IN_MOVE_SELF)
+                inotify_rm_watch(w->inotify_fd, wd);
+              if (ev->mask & (IN_IGNORED | IN_MOVE_SELF))
+                wd = -1;
+            }
+          }
         }
+        if (poll(pfd, 1, 50) <= 0)
+          break;
+      }
+      for (auto &[path, wd] : watches) {
+        if (wd == -1 && (wd = inotify_add_watch(w->inotify_fd, path.c_str(),
+                                                 path_watch_events)) != -1)
+          mark(path);
       }
-      if (!found)
-        cerr << query << ": not found\n";
     }
-    restore_io_lambda();
-    return true;
-  } else if (cmd_name == "kill") {
-    if (cmd.args.size() < 2) {
-      cout << "[Usage]: kill <pid> <signal>\n";
-      restore_io_lambda();
-      return true;
+
+    bool changed = false;
+    for (size_t i = 0; i < index.dirs.size(); i++) {
+      if (!dirty[i])
+        continue;
+      PathDir &dir = index.dirs[i];
+      struct stat st;
+      dir.present = stat(dir.path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+      if (dir.present) {
+        dir.mtime = st.st_mtim;
+        scan_path_dir(dir);
+      } else {
+        dir.names.clear();
+      }
+      changed = true;
     }
-    try {
-      pid_t pid = stoi(cmd.args[1]);
-      int sig = SIGTERM;
-      if (cmd.args.size() == 3)
-        sig = stoi(cmd.args[2]);
-      if (kill(pid, sig) != 0)
-        perror(("kill " + to_string(pid)).c_str());
-    } catch (const exception &e) {
-      cerr << "kill: invalid argument " << e.what() << "\n";
-    }
-    restore_io_lambda();
-    return true;
-  } else if (cmd_name == "echo") {
-    for (size_t i = 1; i < cmd.args.size(); i++) {
-      cout << cmd.args[i];
-      if (i != cmd.args.size() - 1)
-        cout << " ";
+    if (changed || !index.built) {
+      build_commands(index);
+      post_path_index(w, index);
     }
-    cout << "\n";
-    restore_io_lambda();
-    return true;
   }
+}
 
-  restore_io_lambda();
-  return false;
+// Starts the watcher; without inotify the index is revalidated by
+// refresh_path_index() as in a script.
+void init_path_watcher() {
+  auto *w = new PathWatcher;
+  w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (w->inotify_fd == -1 || pipe2(w->wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+    if (w->inotify_fd != -1)
+      close(w->inotify_fd);
+    delete w;
+    return;
+  }
+  const char *env_path = get_var("PATH");
+  w->path_env = env_path ? env_path : "";
+  path_watcher = w;
+  thread(path_watcher_loop, w).detach();
 }
 
-void exe_extr(const Command &cmd) {
-  pid_t pid = fork();
-  if (pid == 0) {
-    // Child
-    if (cmd.redirect_stdout && !cmd.stdout_file.empty()) {
-      int flags = O_WRONLY | O_CREAT | (cmd.append_stdout ? O_APPEND : O_TRUNC);
-      int fd = open(cmd.stdout_file.c_str(), flags, 0644);
-      if (fd == -1) {
-        perror(("cannot open file: " + cmd.stdout_file).c_str());
-        exit(1);
-      }
-      dup2(fd, STDOUT_FILENO);
-      close(fd);
-    }
-    if (cmd.redirect_stderr && !cmd.stderr_file.empty()) {
-      int flags = O_WRONLY | O_CREAT | (cmd.append_stderr ? O_APPEND : O_TRUNC);
-      int fd = open(cmd.stderr_file.c_str(), flags, 0644);
-      if (fd == -1) {
-        perror(("cannot open file: " + cmd.stderr_file).c_str());
-        exit(1);
+// Takes the newest index the watcher finished, if there is one; with
+// `wait`, blocks until there is one for the $PATH wanted now.
+void adopt_path_index(bool wait = false) {
+  PathWatcher *w = path_watcher;
+  unique_ptr<PathIndex> ready;
+  {
+    unique_lock<mutex> guard(w->lock);
+    if (wait && (!path_index.built || path_index.path_env != w->path_env))
+      w->ready_cv.wait(guard, [&] {
+        return w->ready && w->ready->path_env == w->path_env;
+      });
+    ready = move(w->ready);
+  }
+  if (!ready)
+    return;
+  if (path_index.built && ready->path_env != path_index.path_env)
+    command_hash.clear();
+  path_index = move(*ready);
+}
+
+void refresh_path_index() {
+  const char *env_path = get_var("PATH");
+  string path_env = env_path ? env_path : "";
+  if (path_watcher) {
+    if (path_env != path_watcher->path_env) {
+      {
+        lock_guard<mutex> guard(path_watcher->lock);
+        path_watcher->path_env = path_env;
       }
-      dup2(fd, STDERR_FILENO);
-      close(fd);
+      command_hash.clear();
+      char byte = 0;
+      [[maybe_unused]] ssize_t n = write(path_watcher->wake[1], &byte, 1);
     }
+    adopt_path_index();
+    return;
+  }
+  bool changed = !path_index.built;
 
-    vector<char *> argv;
-    for (const auto &s : cmd.args)
-      argv.push_back(const_cast<char *>(s.c_str()));
-    argv.push_back(nullptr);
-
-    execvp(argv[0], argv.data());
-    cerr << RED << "fero: command not found: " << argv[0] << RESET << endl;
-    exit(1);
-  } else if (pid > 0) {
-    int status;
-    waitpid(pid, &status, 0);
-  } else {
-    perror("fork");
+  if (path_env != path_index.path_env) {
+    set_path_dirs(path_index, path_env);
+    // Until the first build, path_var_changed() kept the hash current.
+    if (path_index.built)
+      command_hash.clear();
+    changed = true;
   }
-}
 
-int main() {
-  cout << "\033[2J\033[H" << flush; 
-  while (true) {
-    string cwd = filesystem::current_path();
-    cout << "\033[36m" << cwd << "\033[0m" << "\n" << PROMPT << flush;
-    string input = read_input();
-    if (input.empty())
+  for (auto &dir : path_index.dirs) {
+    struct stat st;
+    if (stat(dir.path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+      if (dir.present) {
+        dir.present = false;
+        dir.names.clear();
+        changed = true;
+      }
       continue;
+    }
+    if (!dir.present || st.st_mtim.tv_sec != dir.mtime.tv_sec ||
+        st.st_mtim.tv_nsec != dir.mtime.tv_nsec) {
+      dir.present = true;
+      dir.mtime = st.st_mtim;
+      scan_path_dir(dir);
+      changed = true;
+    }
+  }
 
-    Command cmd = parse_cmd(input);
-    if (cmd.args.empty())
-      continue;
+  if (changed)
+    build_commands(path_index);
+}
 
-    if (run_builtin(cmd))
-      continue;
+// A change to PATH makes the command index follow it straight away, once
+// there is one. A script that never asked for it only forgets its hash.
+void path_var_changed() {
+  if (path_watcher || path_index.built)
+    refresh_path_index();
+  else
+    command_hash.clear();
+}
 
-    exe_extr(cmd);
+// Looks `name` up in the index, waiting for the watcher if it has not
+// built one for the current $PATH yet.
+const string *lookup_command(string_view name) {
+  if (path_watcher)
+    adopt_path_index(true);
+  else if (!path_index.built)
+    refresh_path_index();
+  auto it = path_index.commands.find(string(name));
+  return it == path_index.commands.end() ? nullptr : &it->second;
+}
+
+// `name` looked up in the PATH of `envp` directly, without the index. The
+// prompt worker can't use getenv() or posix_spawnp(), which read the
+// environment the main thread may be changing.
+string search_path(const char *name, char *const envp[]) {
+  string_view path;
+  for (char *const *e = envp; *e; e++) {
+    if (strncmp(*e, "PATH=", 5) == 0)
+      path = *e + 5;
+  }
+  while (!path.empty()) {
+    size_t colon = path.find(':');
+    string dir(path.substr(0, colon));
+    string file = (dir.empty() ? "." : dir) + "/" + name;
+    if (access(file.c_str(), X_OK) == 0)
+      return file;
+    path = colon == string_view::npos ? "" : path.substr(colon + 1);
+  }
+  return "";
+}
+
+// Returns the path to exec for `name`, or nullptr when it is not a command.
+// Names containing a slash are used as they are, so `name` must be
+// NUL-terminated like the argv words it comes from.
+const char *resolve_command(string_view name) {
+  if (name.find('/') != string::npos)
+    return name.data();
+  auto it = command_hash.find(string(name));
+  if (it == command_hash.end()) {
+    // Scripts run a handful of distinct commands, so until something needs
+    // the whole index a few access() calls beat scanning every directory.
+    const string *path = nullptr;
+    if (path_watcher || path_index.built) {
+      path = lookup_command(name);
+      stats.index_hits += path != nullptr;
+      if (!path) {
+        // Something may have been installed since the index was last
+        // checked, or so recently that the watcher hasn't caught up.
+        refresh_path_index();
+        path = lookup_command(name);
+      }
+    }
+    string found;
+    if (!path) {
+      stats.path_searches++;
+      found = search_path(name.data(), shell_envp.data());
+      path = found.empty() ? nullptr : &found;
+    }
+    if (!path)
+      return nullptr;
+    it = command_hash.emplace(name, HashedCommand{*path, 0}).first;
+  } else {
+    stats.hash_hits++;
+  }
+  it->second.hits++;
+  return it->second.path.c_str();
+}
+
+Matches get_matches(string_view prefix) {
+  CompletionTimer timer;
+  if (path_watcher)
+    adopt_path_index();
+  const auto &names = path_index.sorted;
+  Matches m;
+  m.first = lower_bound(names.begin(), names.end(), prefix,
+                        [](const string &s, string_view p) { return s < p; });
+  m.last = partition_point(m.first, names.end(), [&](const string &s) {
+    return s.compare(0, prefix.size(), prefix) == 0;
+  });
+  if (m.empty())
+    return m;
+
+  // In a sorted run the common prefix of all entries is the common prefix
+  // of the first and the last one.
+  const string &a = *m.first, &b = *(m.last - 1);
+  size_t n = prefix.size();
+  while (n < a.size() && n < b.size() && a[n] == b[n])
+    n++;
+  m.lcp = string_view(a).substr(0, n);
+  return m;
+}
+
+// Command history in an append-only file ($HISTFILE, or ~/.fero_history)
+// shared by every fero session. Each entry is framed as
+//
+//   [u32 length][u32 magic] command bytes [u32 length][u32 magic]
+//
+// and appended with one O_APPEND write, so concurrent sessions never
+// interleave. The file is mmap'd rather than parsed: Up/Down walk records
+// backwards from the end through their trailers, and the Ctrl-R index is
+// built on the completion thread from startup on.
+const uint32_t history_magic = 0x31485246; // "FRH1"
+const size_t history_frame = 4 * sizeof(uint32_t);
+
+// A trigram index over the first `records` history records in CSR form.
+// The records containing trigram slot t are postings[starts[t] ..
+// starts[t + 1]), oldest first; `end` is the file offset the records were
+// listed up to, where the next extension picks up.
+struct HistoryIndex {
+  vector<uint32_t> starts, postings;
+  size_t records = 0;
+  size_t end = 0;
+};
+
+struct History {
+  int fd = -1;
+  const char *map = nullptr;
+  size_t mapped = 0;
+  size_t valid_end = 0; // end of the last complete record
+  uint64_t epoch = 0;   // bumped when the file is truncated
+
+  // Ctrl-R support: where each record starts, and the newest index the
+  // completion thread has finished. Records past the index are scanned
+  // directly until there are enough of them to extend it.
+  vector<uint64_t> offsets;
+  size_t offsets_end = 0; // file offset the offsets list reaches
+  shared_ptr<const HistoryIndex> index;
+};
+
+History history;
+
+uint32_t load_u32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+// Length of the record starting at `off` in the `size` bytes at `map`, or
+// -1 if there isn't a whole, well-framed one there.
+ssize_t record_in(const char *map, size_t size, size_t off) {
+  if (off + history_frame > size)
+    return -1;
+  const char *p = map + off;
+  if (load_u32(p + 4) != history_magic)
+    return -1;
+  uint32_t len = load_u32(p);
+  if (off + history_frame + len > size)
+    return -1;
+  const char *t = p + 8 + len;
+  if (load_u32(t) != len || load_u32(t + 4) != history_magic)
+    return -1;
+  return len;
+}
+
+ssize_t history_record_at(size_t off) {
+  return record_in(history.map, history.mapped, off);
+}
+
+string_view entry_in(const char *map, size_t off) {
+  return string_view(map + off + 8, load_u32(map + off));
+}
+
+string_view history_entry(size_t off) { return entry_in(history.map, off); }
+
+// Appends the start of every record from `off` up to `end` to `offsets`,
+// skipping damage byte by byte, and returns where the walk stopped.
+size_t list_records(const char *map, size_t size, size_t off, size_t end,
+                    vector<uint64_t> &offsets) {
+  while (off < end) {
+    ssize_t len = record_in(map, size, off);
+    if (len < 0) {
+      off++;
+      continue;
+    }
+    offsets.push_back(off);
+    off += history_frame + len;
+  }
+  return off;
+}
+
+// Start of the record that ends at `end`, or -1.
+ssize_t history_prev(size_t end) {
+  if (end < history_frame || end > history.mapped)
+    return -1;
+  const char *t = history.map + end - 8;
+  if (load_u32(t + 4) != history_magic)
+    return -1;
+  uint32_t len = load_u32(t);
+  if (end < history_frame + len)
+    return -1;
+  size_t start = end - history_frame - len;
+  return history_record_at(start) == static_cast<ssize_t>(len) ? start : -1;
+}
+
+// Picks up whatever this and other sessions appended since the last call.
+void history_sync() {
+  if (history.fd == -1)
+    return;
+  struct stat st;
+  if (fstat(history.fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) == history.mapped)
+    return;
+  if (history.map)
+    munmap(const_cast<char *>(history.map), history.mapped);
+  history.map = nullptr;
+  history.mapped = 0;
+  // Truncated by someone else: what was read of it is gone.
+  if (static_cast<size_t>(st.st_size) < history.valid_end) {
+    history.valid_end = 0;
+    history.offsets.clear();
+    history.offsets_end = 0;
+    history.index = nullptr;
+    history.epoch++;
+  }
+  if (st.st_size == 0)
+    return;
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+  if (map == MAP_FAILED)
+    return;
+  history.map = static_cast<const char *>(map);
+  history.mapped = st.st_size;
+
+  // Usually the file ends in a complete record and that is all we check.
+  // After a torn write, walk forward from the last known good record and
+  // skip the damage byte by byte.
+  if (history_prev(history.mapped) >= 0) {
+    history.valid_end = history.mapped;
+    return;
+  }
+  size_t off = history.valid_end;
+  while (off + history_frame <= history.mapped) {
+    ssize_t len = history_record_at(off);
+    if (len < 0) {
+      off++;
+      continue;
+    }
+    off += history_frame + len;
+    history.valid_end = off;
+  }
+}
+
+void init_history() {
+  string path;
+  if (const char *file = get_var("HISTFILE"))
+    path = file;
+  else if (const char *home = get_var("HOME"))
+    path = string(home) + "/.fero_history";
+  else
+    return;
+  history.fd =
+      open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  history_sync();
+}
+
+void history_add(const string &line) {
+  if (history.fd == -1 || line.empty() || line.size() > UINT32_MAX)
+    return;
+  history_sync();
+  ssize_t last = history_prev(history.valid_end);
+  if (last >= 0 && history_entry(last) == line)
+    return;
+
+  uint32_t frame[2] = {static_cast<uint32_t>(line.size()), history_magic};
+  string record(reinterpret_cast<const char *>(frame), sizeof frame);
+  record += line;
+  record.append(reinterpret_cast<const char *>(frame), sizeof frame);
+  write_all(history.fd, record.data(), record.size());
+}
+
+// Printable ASCII maps to 1..95 and everything else to 0, so a trigram
+// indexes a flat table of 96^3 slots directly, with no hashing.
+const size_t trigram_slots = 96 * 96 * 96;
+
+uint32_t trigram(const char *p) {
+  auto code = [&](int i) -> uint32_t {
+    uint8_t c = p[i];
+    return c >= 32 && c < 127 ? c - 31 : 0;
+  };
+  return (code(0) * 96 + code(1)) * 96 + code(2);
+}
+
+// Calls f(slot) once for each distinct trigram slot of `text`, record
+// `idx`; `last` remembers which record touched a slot most recently.
+template <typename F>
+void for_each_trigram(string_view text, uint32_t idx, vector<uint32_t> &last,
+                      F &&f) {
+  for (size_t i = 0; i + 3 <= text.size(); i++) {
+    uint32_t slot = trigram(text.data() + i);
+    if (last[slot] != idx) {
+      last[slot] = idx;
+      f(slot);
+    }
+  }
+}
+
+// `base` (null for none) extended with the records from its end up to
+// `end`, or null when there are none. Only the new records are split into
+// trigrams; each slot keeps its old postings and gets the new ones after
+// them. This runs on the completion thread, so it maps the file itself:
+// history_sync() may replace the main thread's mapping at any time.
+shared_ptr<const HistoryIndex> extend_history_index(const HistoryIndex *base,
+                                                    int fd, size_t end) {
+  size_t from = base ? base->end : 0;
+  struct stat st;
+  if (end <= from || fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < end)
+    return nullptr;
+  void *m = mmap(nullptr, end, PROT_READ, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED)
+    return nullptr;
+  const char *map = static_cast<const char *>(m);
+  vector<uint64_t> offsets;
+  auto next = make_shared<HistoryIndex>();
+  next->end = list_records(map, end, from, end, offsets);
+  uint32_t first = base ? base->records : 0;
+  next->records = first + offsets.size();
+
+  // Two passes over the new records: count each slot's, then fill the
+  // postings behind the slot's old ones.
+  vector<uint32_t> added(trigram_slots, 0), last(trigram_slots, UINT32_MAX);
+  for (uint32_t i = 0; i < offsets.size(); i++)
+    for_each_trigram(entry_in(map, offsets[i]), i, last,
+                     [&](uint32_t slot) { added[slot]++; });
+  next->starts.assign(trigram_slots + 1, 0);
+  for (size_t slot = 0; slot < trigram_slots; slot++) {
+    uint32_t had = base ? base->starts[slot + 1] - base->starts[slot] : 0;
+    next->starts[slot + 1] = next->starts[slot] + had + added[slot];
+  }
+
+  next->postings.resize(next->starts.back());
+  vector<uint32_t> fill(next->starts.begin(), next->starts.end() - 1);
+  if (base) {
+    auto b = base->postings.begin();
+    for (size_t slot = 0; slot < trigram_slots; slot++) {
+      copy(b + base->starts[slot], b + base->starts[slot + 1],
+           next->postings.begin() + fill[slot]);
+      fill[slot] += base->starts[slot + 1] - base->starts[slot];
+    }
+  }
+  last.assign(trigram_slots, UINT32_MAX);
+  for (uint32_t i = 0; i < offsets.size(); i++)
+    for_each_trigram(entry_in(map, offsets[i]), i, last, [&](uint32_t slot) {
+      next->postings[fill[slot]++] = first + i;
+    });
+  munmap(m, end);
+  return next;
+}
+
+// Index of the newest record before `before` that contains `query`, or -1.
+// Queries of three or more bytes only look at records holding their rarest
+// trigram; shorter ones match so often that a backwards scan ends quickly.
+ssize_t history_search(string_view query, size_t before) {
+  auto matches = [&](size_t idx) {
+    return history_entry(history.offsets[idx]).find(query) != string::npos;
+  };
+  // Records newer than the index first; until the first index is ready
+  // that is all of them.
+  const HistoryIndex *index = history.index.get();
+  size_t idx = min(before, history.offsets.size());
+  for (; idx > (index ? index->records : 0); idx--) {
+    if (matches(idx - 1))
+      return idx - 1;
+  }
+  if (query.size() < 3 || !index) {
+    while (idx-- > 0) {
+      if (matches(idx))
+        return idx;
+    }
+    return -1;
+  }
+
+  const uint32_t *first = nullptr, *last = nullptr;
+  for (size_t i = 0; i + 3 <= query.size(); i++) {
+    uint32_t slot = trigram(query.data() + i);
+    const uint32_t *b = index->postings.data() + index->starts[slot];
+    const uint32_t *e = index->postings.data() + index->starts[slot + 1];
+    if (!first || e - b < last - first) {
+      first = b;
+      last = e;
+    }
+  }
+  for (const uint32_t *it = lower_bound(first, last, idx); it != first;) {
+    --it;
+    if (matches(*it))
+      return *it;
+  }
+  return -1;
+}
+
+// What the line editor last put on the terminal after the prompt, so each
+// edit sends only the difference. Positions count columns from the start
+// of the prompt, which lets long lines wrap.
+struct LineView {
+  size_t prompt_width = 2; // visible width of PROMPT
+  size_t cols = 80;
+  string shown;
+  size_t cursor = 0; // index into shown
+};
+
+// Appends the escapes that move the cursor between two column positions.
+void move_cursor(string &out, const LineView &view, size_t from, size_t to) {
+  size_t from_row = from / view.cols, to_row = to / view.cols;
+  size_t from_col = from % view.cols, to_col = to % view.cols;
+  if (to_row < from_row)
+    out += "\033[" + to_string(from_row - to_row) + "A";
+  else if (to_row > from_row)
+    out += "\033[" + to_string(to_row - from_row) + "B";
+  if (to_col == from_col)
+    return;
+  if (to_col == 0)
+    out += '\r';
+  else if (to_col < from_col)
+    out += "\033[" + to_string(from_col - to_col) + "D";
+  else
+    out += "\033[" + to_string(to_col - from_col) + "C";
+}
+
+// Builds the minimal update from what is shown to `input` with the cursor
+// at `cursor`: skip the common prefix, rewrite the rest, clear any leftover
+// tail, then put the cursor back.
+void render_line(LineView &view, const string &input, size_t cursor,
+                 string &out) {
+  size_t common = 0;
+  while (common < view.shown.size() && common < input.size() &&
+         view.shown[common] == input[common])
+    common++;
+
+  size_t pw = view.prompt_width;
+  size_t pos = pw + view.cursor;
+  if (common < view.shown.size() || common < input.size()) {
+    move_cursor(out, view, pos, pw + common);
+    out.append(input, common, string::npos);
+    pos = pw + input.size();
+    // After the last column the terminal holds the cursor there until the
+    // next character; step onto the new row so positions stay exact.
+    if (input.size() > common && pos % view.cols == 0)
+      out += "\r\n";
+    if (input.size() < view.shown.size())
+      out += "\033[J";
+  }
+  move_cursor(out, view, pos, pw + cursor);
+  view.shown = input;
+  view.cursor = cursor;
+}
+
+bool write_pending(string &out) {
+  bool ok = write_all(STDOUT_FILENO, out.data(), out.size());
+  out.clear();
+  return ok;
+}
+
+// The logical working directory, $PWD-style: the path cd was given, with
+// symlinks kept, rather than what getcwd() resolves it to. Only cd changes
+// it, and its prompt segment is formatted once per change.
+string shell_pwd;
+string prompt_pwd;
+
+// `path` made absolute against `base`, with `.`, `..` and repeated slashes
+// resolved by name alone, as cd does.
+string logical_path(string_view base, string_view path) {
+  vector<string_view> parts;
+  auto add = [&](string_view p) {
+    while (!p.empty()) {
+      size_t slash = p.find('/');
+      string_view part = p.substr(0, slash);
+      if (part == "..") {
+        if (!parts.empty())
+          parts.pop_back();
+      } else if (!part.empty() && part != ".") {
+        parts.push_back(part);
+      }
+      p = slash == string_view::npos ? "" : p.substr(slash + 1);
+    }
+  };
+  if (path.empty() || path[0] != '/')
+    add(base);
+  add(path);
+  if (parts.empty())
+    return "/";
+  string out;
+  for (string_view part : parts) {
+    out += '/';
+    out += part;
+  }
+  return out;
+}
+
+void set_pwd(const string &pwd) {
+  if (!shell_pwd.empty())
+    set_var("OLDPWD", shell_pwd, true);
+  shell_pwd = pwd;
+  set_var("PWD", shell_pwd, true);
+  prompt_pwd = DGREEN + shell_pwd + RESET;
+}
+
+// Takes $PWD when it is an absolute, normalized name for the directory we
+// are in, so a path through a symlink survives into the shell; otherwise
+// asks getcwd().
+void init_pwd() {
+  const char *env = get_var("PWD");
+  struct stat a, b;
+  if (env && env[0] == '/' && logical_path("/", env) == env &&
+      stat(env, &a) == 0 && stat(".", &b) == 0 && a.st_dev == b.st_dev &&
+      a.st_ino == b.st_ino) {
+    set_pwd(env);
+    return;
+  }
+  char buf[PATH_MAX];
+  set_pwd(getcwd(buf, sizeof buf) ? buf : "/");
+}
+
+// One directory as getdents64() returned it: the names, NUL-separated in
+// a single buffer, and the d_type of each. Nothing is stat'ed to build it.
+struct DirEntry {
+  uint32_t name; // offset into DirListing::names
+  uint8_t type;  // DT_*; DT_UNKNOWN on filesystems that don't say
+};
+
+struct DirListing {
+  string names;
+  vector<DirEntry> entries;
+  struct timespec mtime = {0, 0};
+  chrono::steady_clock::time_point read_at;
+
+  const char *name(const DirEntry &e) const { return names.data() + e.name; }
+};
+
+// Listings read in the last couple of seconds, by absolute path, for glob
+// expansion and completion. An entry is only reused while the directory's
+// mtime is unchanged, and the age limit covers changes within one mtime
+// tick.
+struct ListingCache {
+  mutex lock; // the completion thread uses it too
+  unordered_map<string, shared_ptr<const DirListing>> dirs;
+  size_t limit = 64;
+};
+
+ListingCache listing_cache;
+const auto listing_ttl = chrono::seconds(2);
+
+// Reads the directory at `path` (absolute) into a new listing; null when it
+// can't be opened, or when `wanted` is given and moves off `gen` before
+// the read is done.
+shared_ptr<DirListing> read_listing(const string &path,
+                                    const atomic<uint64_t> *wanted,
+                                    uint64_t gen) {
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return nullptr;
+  auto listing = make_shared<DirListing>();
+  struct stat st;
+  if (fstat(fd, &st) == 0)
+    listing->mtime = st.st_mtim;
+  listing->read_at = chrono::steady_clock::now();
+
+  auto buf = make_unique<char[]>(1 << 18);
+  ssize_t n;
+  while ((n = getdents64(fd, buf.get(), 1 << 18)) > 0) {
+    if (wanted && *wanted != gen) {
+      close(fd);
+      return nullptr;
+    }
+    for (ssize_t off = 0; off < n;) {
+      auto *ent = reinterpret_cast<struct dirent64 *>(buf.get() + off);
+      off += ent->d_reclen;
+      const char *name = ent->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+      listing->entries.push_back(
+          {static_cast<uint32_t>(listing->names.size()), ent->d_type});
+      listing->names.append(name, strlen(name) + 1);
+    }
+  }
+  close(fd);
+  return listing;
+}
+
+// The listing of `path` (absolute), from the cache when it is still good.
+// `wanted` and `gen` let a read for completion be abandoned.
+shared_ptr<const DirListing> list_dir(const string &path,
+                                      const atomic<uint64_t> *wanted = nullptr,
+                                      uint64_t gen = 0) {
+  shared_ptr<const DirListing> old;
+  {
+    lock_guard<mutex> guard(listing_cache.lock);
+    auto it = listing_cache.dirs.find(path);
+    if (it != listing_cache.dirs.end())
+      old = it->second;
+  }
+  struct stat st;
+  if (old && chrono::steady_clock::now() - old->read_at < listing_ttl &&
+      stat(path.c_str(), &st) == 0 && st.st_mtim.tv_sec == old->mtime.tv_sec &&
+      st.st_mtim.tv_nsec == old->mtime.tv_nsec)
+    return old;
+  shared_ptr<const DirListing> listing = read_listing(path, wanted, gen);
+  if (!listing)
+    return nullptr;
+  auto now = chrono::steady_clock::now();
+  lock_guard<mutex> guard(listing_cache.lock);
+  if (listing_cache.dirs.size() >= listing_cache.limit) {
+    for (auto e = listing_cache.dirs.begin(); e != listing_cache.dirs.end();) {
+      if (now - e->second->read_at >= listing_ttl)
+        e = listing_cache.dirs.erase(e);
+      else
+        ++e;
+    }
+    if (listing_cache.dirs.size() >= listing_cache.limit)
+      listing_cache.dirs.clear();
+  }
+  listing_cache.dirs[path] = listing;
+  return listing;
+}
+
+// A path as the kernel should open it, made absolute against the logical
+// working directory so cache entries survive cd.
+string absolute_dir(string_view dir) {
+  if (!dir.empty() && dir[0] == '/')
+    return string(dir);
+  string path = shell_pwd;
+  if (!dir.empty()) {
+    if (path.back() != '/')
+      path += '/';
+    path += dir;
+  }
+  return path;
+}
+
+// One path component of a glob, compiled once: runs of literal text,
+// `?`, `*` and bracket classes.
+struct GlobOp {
+  enum Kind : uint8_t { Literal, One, Star, Class } kind;
+  string_view text;   // Literal
+  uint32_t charclass; // Class: index into GlobPattern::classes
+};
+
+struct GlobPattern {
+  vector<GlobOp> ops;
+  vector<bitset<256>> classes;
+  bool dot = false; // starts with a literal '.', so it may match dotfiles
+};
+
+bool has_glob_chars(string_view s) {
+  return s.find_first_of("*?[") != string_view::npos;
+}
+
+// Compiles one component. `[` without a closing `]` is literal, as in sh;
+// returns false when nothing in it is special after all.
+bool compile_glob(string_view s, GlobPattern &pat) {
+  pat.ops.clear();
+  pat.classes.clear();
+  pat.dot = !s.empty() && s[0] == '.';
+  bool special = false;
+  size_t lit = 0;
+  auto flush = [&](size_t end) {
+    if (end > lit)
+      pat.ops.push_back({GlobOp::Literal, s.substr(lit, end - lit), 0});
+  };
+  for (size_t i = 0; i < s.size(); i++) {
+    char ch = s[i];
+    if (ch == '*' || ch == '?') {
+      flush(i);
+      // `**` in a component is the same as `*`.
+      if (ch == '?' || pat.ops.empty() || pat.ops.back().kind != GlobOp::Star)
+        pat.ops.push_back({ch == '*' ? GlobOp::Star : GlobOp::One, {}, 0});
+      lit = i + 1;
+      special = true;
+    } else if (ch == '[') {
+      size_t j = i + 1;
+      bool negate = j < s.size() && (s[j] == '!' || s[j] == '^');
+      if (negate)
+        j++;
+      size_t first = j;
+      // A `]` right after the opening bracket is a member, not the end.
+      while (j < s.size() && (s[j] != ']' || j == first))
+        j++;
+      if (j >= s.size())
+        continue;
+      bitset<256> set;
+      for (size_t k = first; k < j; k++) {
+        unsigned char lo = s[k];
+        if (k + 2 < j && s[k + 1] == '-') {
+          unsigned char hi = s[k + 2];
+          for (unsigned c = lo; c <= hi; c++)
+            set.set(c);
+          k += 2;
+        } else {
+          set.set(lo);
+        }
+      }
+      if (negate)
+        set.flip();
+      flush(i);
+      pat.ops.push_back({GlobOp::Class, {},
+                         static_cast<uint32_t>(pat.classes.size())});
+      pat.classes.push_back(set);
+      lit = j + 1;
+      i = j;
+      special = true;
+    }
+  }
+  flush(s.size());
+  return special;
+}
+
+// Matches `name` against a compiled component. On a mismatch it backs up
+// to the last `*` only, so a name is scanned about once for the usual
+// patterns.
+bool glob_match(const GlobPattern &pat, string_view name) {
+  if (name[0] == '.' && !pat.dot)
+    return false;
+  size_t op = 0, pos = 0;
+  size_t star_op = SIZE_MAX, star_pos = 0;
+  while (true) {
+    if (op < pat.ops.size()) {
+      const GlobOp &g = pat.ops[op];
+      switch (g.kind) {
+      case GlobOp::Star:
+        star_op = ++op;
+        star_pos = pos;
+        continue;
+      case GlobOp::Literal:
+        if (name.compare(pos, g.text.size(), g.text) == 0) {
+          pos += g.text.size();
+          op++;
+          continue;
+        }
+        break;
+      case GlobOp::One:
+        if (pos < name.size()) {
+          pos++;
+          op++;
+          continue;
+        }
+        break;
+      case GlobOp::Class:
+        if (pos < name.size() &&
+            pat.classes[g.charclass].test(
+                static_cast<unsigned char>(name[pos]))) {
+          pos++;
+          op++;
+          continue;
+        }
+        break;
+      }
+    } else if (pos == name.size()) {
+      return true;
+    }
+    // Let the last `*` take one more character and try again.
+    if (star_op == SIZE_MAX || star_pos >= name.size())
+      return false;
+    op = star_op;
+    pos = ++star_pos;
+  }
+}
+
+// Whether `path` names a directory. d_type answers without a stat except
+// for symlinks, which are followed, and filesystems that leave it unknown.
+bool entry_is_dir(const DirEntry &e, const string &path) {
+  if (e.type == DT_DIR)
+    return true;
+  if (e.type != DT_LNK && e.type != DT_UNKNOWN)
+    return false;
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool is_real_dir(const DirEntry &e, const string &path) {
+  struct stat st;
+  return e.type == DT_DIR || (e.type == DT_UNKNOWN &&
+                              lstat(path.c_str(), &st) == 0 &&
+                              S_ISDIR(st.st_mode));
+}
+
+// Expands the components parts[i..] below `prefix` (empty, or ending in
+// '/') into `out`. `**` matches any number of directories, without
+// following symlinks, and as the last component everything below.
+void glob_walk(const vector<string_view> &parts, size_t i, string &prefix,
+               vector<string> &out) {
+  if (i == parts.size()) {
+    out.push_back(prefix);
+    return;
+  }
+  string_view part = parts[i];
+  bool last = i + 1 == parts.size();
+  bool globstar = part == "**";
+  size_t len = prefix.size();
+  GlobPattern pat;
+  if (globstar && !last) {
+    glob_walk(parts, i + 1, prefix, out);
+  } else if (!globstar && !compile_glob(part, pat)) {
+    prefix += part;
+    struct stat st;
+    if (!last) {
+      prefix += '/';
+      glob_walk(parts, i + 1, prefix, out);
+    } else if (lstat(prefix.c_str(), &st) == 0) {
+      out.push_back(prefix);
+    }
+    prefix.resize(len);
+    return;
+  }
+
+  auto listing = list_dir(absolute_dir(prefix));
+  if (!listing)
+    return;
+  for (const DirEntry &e : listing->entries) {
+    string_view name = listing->name(e);
+    if (globstar) {
+      if (name[0] == '.')
+        continue;
+      prefix += name;
+      if (last)
+        out.push_back(prefix);
+      if (is_real_dir(e, prefix)) {
+        prefix += '/';
+        glob_walk(parts, i, prefix, out);
+      }
+    } else if (glob_match(pat, name)) {
+      prefix += name;
+      if (last) {
+        out.push_back(prefix);
+      } else if (entry_is_dir(e, prefix)) {
+        prefix += '/';
+        glob_walk(parts, i + 1, prefix, out);
+      }
+    }
+    prefix.resize(len);
+  }
+}
+
+// Pathname expansion of one word: the matching paths, sorted, or nothing
+// when no path matches and the word should be kept as it is. A trailing
+// slash only matches directories.
+vector<string> expand_glob(string_view word) {
+  size_t pos = 0;
+  while (pos < word.size() && word[pos] == '/')
+    pos++;
+  string prefix(word.substr(0, pos));
+  bool dirs_only = false;
+  while (word.size() > pos && word.back() == '/') {
+    word.remove_suffix(1);
+    dirs_only = true;
+  }
+  vector<string_view> parts;
+  while (pos < word.size()) {
+    size_t slash = min(word.find('/', pos), word.size());
+    if (slash > pos)
+      parts.push_back(word.substr(pos, slash - pos));
+    pos = slash + 1;
+  }
+  vector<string> out;
+  if (parts.empty())
+    return out;
+  glob_walk(parts, 0, prefix, out);
+  if (dirs_only) {
+    struct stat st;
+    out.erase(remove_if(out.begin(), out.end(),
+                        [&](const string &path) {
+                          return stat(path.c_str(), &st) != 0 ||
+                                 !S_ISDIR(st.st_mode);
+                        }),
+              out.end());
+    for (auto &path : out)
+      path += '/';
+  }
+  sort(out.begin(), out.end());
+  return out;
+}
+
+// What a word needs before it is used, in Command::expand.
+const uint8_t expand_vars_flag = 1; // has a `$` outside single quotes
+const uint8_t expand_glob_flag = 2; // has an unquoted *, ? or [
+const uint8_t expand_drop_flag = 4; // unquoted, so gone if it expands to ""
+
+bool needs_expansion(const Command &cmd) {
+  return cmd.expand || cmd.assigns || cmd.expand_stdin ||
+         cmd.stdout_to.expand || cmd.stderr_to.expand;
+}
+
+// `cmd` as it should run, in `arena`: variables expanded, then the words
+// marked for pathname expansion replaced by what they match, and leading
+// NAME=value words moved into `env`. False, with the error reported, when
+// a redirect target expands to nothing.
+bool expand_command(const Command &cmd, Arena &arena, Command &out) {
+  out = cmd;
+  vector<char *> words, env;
+  for (size_t i = 0; i < cmd.args.size(); i++) {
+    uint8_t flags = cmd.expand ? cmd.expand[i] : 0;
+    string word(cmd.args[i]);
+    if (flags & expand_vars_flag)
+      word = expand_vars(word);
+    if (i < cmd.assigns) {
+      env.push_back(arena_copy(arena, word));
+      continue;
+    }
+    if ((flags & expand_drop_flag) && word.empty())
+      continue;
+    vector<string> paths;
+    if (flags & expand_glob_flag)
+      paths = expand_glob(word);
+    if (paths.empty())
+      words.push_back(arena_copy(arena, word));
+    for (const auto &path : paths)
+      words.push_back(arena_copy(arena, path));
+  }
+  // An empty target would read as no redirect at all. A here-document or
+  // here-string may well expand to nothing.
+  auto target = [&](string_view &file, bool text) {
+    string path = expand_vars(file);
+    if (path.empty() && !text) {
+      cerr << "fero: " << file << ": ambiguous redirect\n";
+      return false;
+    }
+    file = arena_copy(arena, path);
+    return true;
+  };
+  if (cmd.expand_stdin && !target(out.stdin_file, cmd.stdin_text))
+    return false;
+  for (auto to : {&out.stdout_to, &out.stderr_to}) {
+    if (to->expand && !target(to->file, false))
+      return false;
+    to->expand = false;
+  }
+
+  auto to_arena = [&](vector<char *> &v) {
+    v.push_back(nullptr);
+    auto **p =
+        static_cast<char **>(arena_alloc(arena, v.size() * sizeof(char *)));
+    copy(v.begin(), v.end(), p);
+    return p;
+  };
+  out.expand = nullptr;
+  out.assigns = 0;
+  out.expand_stdin = false;
+  out.args.argc = words.size();
+  out.args.argv = to_arena(words);
+  out.env = env.empty() ? nullptr : to_arena(env);
+  return true;
+}
+
+// The stages of a pipeline as they should run: `stages` itself unless one
+// needs expanding, which is redone on every run since the Ast is cached.
+// Null when one of them can't be expanded.
+const Command *expand_stages(const Command *stages, size_t n, Arena &arena,
+                             vector<Command> &expanded) {
+  size_t i = 0;
+  while (i < n && !needs_expansion(stages[i]))
+    i++;
+  if (i == n)
+    return stages;
+  expanded.resize(n);
+  for (i = 0; i < n; i++) {
+    if (needs_expansion(stages[i])) {
+      if (!expand_command(stages[i], arena, expanded[i]))
+        return nullptr;
+    } else
+      expanded[i] = stages[i];
+  }
+  return expanded.data();
+}
+
+// A decoded keypress. Text carries a run of printable characters, from a
+// bracketed paste or from a burst of typed or pasted bytes, so it can be
+// inserted in one step.
+enum class KeyType {
+  Text,
+  Enter,
+  Tab,
+  Backspace,
+  Delete,
+  Left,
+  Right,
+  Up,
+  Down,
+  Home,
+  End,
+  Search, // Ctrl-R
+  Cancel, // Ctrl-G
+  Other,
+};
+
+struct Key {
+  KeyType type = KeyType::Other;
+  string text;
+};
+
+// Reads the terminal in bulk and decodes whole key sequences from the
+// buffer. Bytes left over after Enter stay here for the next line.
+struct InputReader {
+  char buf[4096];
+  size_t start = 0, end = 0;
+
+  bool buffered() const { return start < end; }
+};
+
+InputReader term_input;
+
+const char *const paste_end = "\033[201~";
+
+// True when more keys are already waiting, so a redraw can wait until the
+// burst has been read.
+bool input_pending() {
+  if (term_input.buffered())
+    return true;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+// Refills the buffer with whatever the terminal has. With a timeout (in ms)
+// it may give up and return false; otherwise a closed terminal ends the
+// shell.
+bool fill_input(struct termios &org_ter, int timeout_ms = -1) {
+  InputReader &in = term_input;
+  if (in.start == in.end) {
+    in.start = in.end = 0;
+  } else if (in.start > 0) {
+    memmove(in.buf, in.buf + in.start, in.end - in.start);
+    in.end -= in.start;
+    in.start = 0;
+  }
+  if (in.end == sizeof in.buf)
+    return true;
+  if (timeout_ms >= 0) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+      return false;
+  }
+  while (true) {
+    ssize_t n = read(STDIN_FILENO, in.buf + in.end, sizeof in.buf - in.end);
+    if (n > 0) {
+      in.end += n;
+      return true;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    disableRawMode(org_ter);
+    cout << "\033[?2004l" << endl;
+    exit(last_status);
+  }
+}
+
+// Makes sure at least `n` bytes are buffered. Escape sequences arrive in
+// one piece from a terminal, so a short wait is enough to tell a lone ESC
+// from the start of a sequence.
+bool have_bytes(struct termios &org_ter, size_t n) {
+  while (term_input.end - term_input.start < n) {
+    if (!fill_input(org_ter, 50))
+      return false;
+  }
+  return true;
+}
+
+Key decode_paste(struct termios &org_ter) {
+  InputReader &in = term_input;
+  Key key;
+  key.type = KeyType::Text;
+  size_t end_len = strlen(paste_end);
+  while (true) {
+    string_view avail(in.buf + in.start, in.end - in.start);
+    size_t stop = avail.find(paste_end);
+    // Leave a possibly split end marker in the buffer for the next read.
+    size_t take = stop != string_view::npos ? stop
+                  : avail.size() >= end_len ? avail.size() - end_len + 1
+                                            : 0;
+    for (char ch : avail.substr(0, take)) {
+      if (ch == '\n' || ch == '\r' || ch == '\t')
+        key.text += ' ';
+      else if (isprint(static_cast<unsigned char>(ch)))
+        key.text += ch;
+    }
+    in.start += take;
+    if (stop != string_view::npos) {
+      in.start += end_len;
+      return key;
+    }
+    fill_input(org_ter);
+  }
+}
+
+Key decode_escape(struct termios &org_ter) {
+  InputReader &in = term_input;
+  Key key;
+  in.start++; // ESC
+  if (!have_bytes(org_ter, 1))
+    return key;
+  char kind = in.buf[in.start];
+  if (kind != '[' && kind != 'O')
+    return key;
+  in.start++;
+
+  // Parameter bytes, then one final byte in @..~.
+  string params;
+  while (true) {
+    if (!have_bytes(org_ter, 1))
+      return key;
+    char ch = in.buf[in.start++];
+    if (ch < 0x40 || ch > 0x7e) {
+      params += ch;
+      continue;
+    }
+    if (ch == '~') {
+      if (params == "200")
+        return decode_paste(org_ter);
+      if (params == "1" || params == "7")
+        key.type = KeyType::Home;
+      else if (params == "4" || params == "8")
+        key.type = KeyType::End;
+      else if (params == "3")
+        key.type = KeyType::Delete;
+      return key;
+    }
+    switch (ch) {
+    case 'A':
+      key.type = KeyType::Up;
+      break;
+    case 'B':
+      key.type = KeyType::Down;
+      break;
+    case 'C':
+      key.type = KeyType::Right;
+      break;
+    case 'D':
+      key.type = KeyType::Left;
+      break;
+    case 'H':
+      key.type = KeyType::Home;
+      break;
+    case 'F':
+      key.type = KeyType::End;
+      break;
+    }
+    return key;
+  }
+}
+
+Key read_key(struct termios &org_ter) {
+  InputReader &in = term_input;
+  if (!in.buffered())
+    fill_input(org_ter);
+
+  Key key;
+  char ch = in.buf[in.start];
+  if (ch == '\033')
+    return decode_escape(org_ter);
+  if (isprint(static_cast<unsigned char>(ch))) {
+    // Take the whole run of printable bytes already buffered.
+    key.type = KeyType::Text;
+    size_t end = in.start;
+    while (end < in.end && isprint(static_cast<unsigned char>(in.buf[end])))
+      end++;
+    key.text.assign(in.buf + in.start, end - in.start);
+    in.start = end;
+    return key;
+  }
+  in.start++;
+  if (ch == '\n' || ch == '\r')
+    key.type = KeyType::Enter;
+  else if (ch == '\t')
+    key.type = KeyType::Tab;
+  else if (ch == 127 || ch == 8)
+    key.type = KeyType::Backspace;
+  else if (ch == 0x12)
+    key.type = KeyType::Search;
+  else if (ch == 0x07)
+    key.type = KeyType::Cancel;
+  return key;
+}
+
+// The line above the `$ ` prompt is made of segments. Fast ones are
+// rendered each time the prompt is drawn. Slow ones, such as git status,
+// run on the prompt worker thread: the prompt shows at once with the last
+// value seen in this directory, and the line is redrawn in place when a
+// fresher one arrives. render() returns false when it has no new value,
+// e.g. after a timeout, and the old one stays.
+struct PromptSegment {
+  const char *name;
+  bool slow;
+  bool (*render)(const string &dir, char *const envp[], string &out);
+};
+
+bool segment_pwd(const string &, char *const[], string &out) {
+  out = prompt_pwd;
+  return true;
+}
+
+bool segment_status(const string &, char *const[], string &out) {
+  out.clear();
+  if (last_status != 0)
+    out = " " RED "[" + to_string(last_status) + "]" RESET;
+  return true;
+}
+
+const int git_timeout_ms = 1000;
+
+// Branch and dirty state from one `git status --branch --porcelain`; a
+// directory outside a repository renders as nothing.
+bool segment_git(const string &dir, char *const envp[], string &out) {
+  string git = search_path("git", envp);
+  int pfd[2];
+  if (git.empty() || pipe2(pfd, O_CLOEXEC) != 0)
+    return false;
+  const char *argv[] = {"git",  "-C",       dir.c_str(),         "status",
+                        "--branch", "--porcelain", "--untracked-files=no",
+                        nullptr};
+  // A clone child that signals nothing when it exits. The shell's
+  // wait4(-1) reapers only collect SIGCHLD children, so this one is killed
+  // and reaped through its pidfd alone, and its pid can't be reused under
+  // us.
+  int pidfd = -1;
+  struct clone_args args = {};
+  args.flags = CLONE_PIDFD;
+  args.pidfd = reinterpret_cast<uintptr_t>(&pidfd);
+  pid_t pid = syscall(SYS_clone3, &args, sizeof args);
+  if (pid == 0) {
+    // Only async-signal-safe calls until exec.
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(pfd[1], STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    // In a group of its own so nothing typed at the terminal reaches it.
+    setpgid(0, 0);
+    execve(git.c_str(), const_cast<char *const *>(argv), envp);
+    _exit(127);
+  }
+  close(pfd[1]);
+  if (pid < 0) {
+    close(pfd[0]);
+    return false;
+  }
+
+  string text;
+  auto deadline = chrono::steady_clock::now() +
+                  chrono::milliseconds(git_timeout_ms);
+  bool timed_out = false;
+  while (true) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(
+        deadline - chrono::steady_clock::now());
+    struct pollfd p = {pfd[0], POLLIN, 0};
+    if (left.count() <= 0 || poll(&p, 1, left.count()) == 0) {
+      timed_out = true;
+      break;
+    }
+    char buf[4096];
+    ssize_t n = read(pfd[0], buf, sizeof buf);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    text.append(buf, n);
+  }
+  close(pfd[0]);
+  if (timed_out)
+    syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, nullptr, 0);
+  siginfo_t info;
+  waitid(P_PIDFD, pidfd, &info, WEXITED | __WALL);
+  close(pidfd);
+  if (timed_out)
+    return false;
+
+  out.clear();
+  if (text.compare(0, 3, "## ") != 0)
+    return true;
+  size_t eol = text.find('\n');
+  string branch = text.substr(3, eol == string::npos ? eol : eol - 3);
+  if (branch.compare(0, 18, "No commits yet on ") == 0)
+    branch.erase(0, 18);
+  size_t dots = branch.find("...");
+  if (dots != string::npos)
+    branch.erase(dots);
+  bool dirty = eol != string::npos && eol + 1 < text.size();
+  out = " " MAGENTA "(" + branch + (dirty ? "*" : "") + ")" RESET;
+  return true;
+}
+
+const PromptSegment prompt_segments[] = {
+    {"pwd", false, segment_pwd},
+    {"git", true, segment_git},
+    {"status", false, segment_status},
+};
+const size_t n_prompt_segments = size(prompt_segments);
+
+// Computes slow segments for the directory the prompt was last drawn in.
+// Requests are coalesced: only the newest one is worked on. Allocated once
+// and never freed, since the detached thread may outlive main().
+struct PromptWorker {
+  mutex lock;
+  condition_variable wake;
+  bool pending = false;
+  string dir;
+  vector<string> env;
+  // Slow segment values by directory, indexed like prompt_segments, for
+  // the `limit` directories shown most recently.
+  struct Cached {
+    vector<string> values;
+    uint64_t used = 0;
+  };
+  unordered_map<string, Cached> cache;
+  size_t limit = 64;
+  uint64_t uses = 0;
+  int notify[2] = {-1, -1}; // a byte means a value changed
+};
+
+PromptWorker *prompt_worker = nullptr;
+string prompt_shown;       // the segment line on screen now
+bool prompt_above = false; // and it is the row right above the input
+
+void prompt_worker_loop(PromptWorker *w) {
+  while (true) {
+    string dir;
+    vector<string> env;
+    {
+      unique_lock<mutex> guard(w->lock);
+      w->wake.wait(guard, [&] { return w->pending; });
+      w->pending = false;
+      dir = w->dir;
+      env = w->env;
+    }
+    vector<char *> envp;
+    for (auto &e : env)
+      envp.push_back(&e[0]);
+    envp.push_back(nullptr);
+
+    vector<string> values(n_prompt_segments);
+    vector<bool> fresh(n_prompt_segments);
+    for (size_t i = 0; i < n_prompt_segments; i++) {
+      if (prompt_segments[i].slow)
+        fresh[i] = prompt_segments[i].render(dir, envp.data(), values[i]);
+    }
+    bool changed = false;
+    {
+      lock_guard<mutex> guard(w->lock);
+      if (w->cache.size() >= w->limit && !w->cache.count(dir))
+        w->cache.erase(min_element(w->cache.begin(), w->cache.end(),
+                                   [](const auto &a, const auto &b) {
+                                     return a.second.used < b.second.used;
+                                   }));
+      auto &entry = w->cache[dir];
+      if (entry.used == 0)
+        entry.used = ++w->uses;
+      vector<string> &cached = entry.values;
+      cached.resize(n_prompt_segments);
+      for (size_t i = 0; i < n_prompt_segments; i++) {
+        if (fresh[i] && cached[i] != values[i]) {
+          cached[i] = values[i];
+          changed = true;
+        }
+      }
+    }
+    if (changed) {
+      char byte = 0;
+      [[maybe_unused]] ssize_t n = write(w->notify[1], &byte, 1);
+    }
+  }
+}
+
+void init_prompt() {
+  auto *w = new PromptWorker;
+  if (pipe2(w->notify, O_CLOEXEC | O_NONBLOCK) != 0) {
+    delete w;
+    return;
+  }
+  prompt_worker = w;
+  thread(prompt_worker_loop, w).detach();
+}
+
+// The segment line for the current directory: fast segments now, slow
+// ones as last cached.
+string prompt_segment_line() {
+  vector<string> cached;
+  if (prompt_worker) {
+    lock_guard<mutex> guard(prompt_worker->lock);
+    auto it = prompt_worker->cache.find(shell_pwd);
+    if (it != prompt_worker->cache.end()) {
+      it->second.used = ++prompt_worker->uses;
+      cached = it->second.values;
+    }
+  }
+  string line, value;
+  for (size_t i = 0; i < n_prompt_segments; i++) {
+    const PromptSegment &seg = prompt_segments[i];
+    if (seg.slow) {
+      if (i < cached.size())
+        line += cached[i];
+    } else if (seg.render(shell_pwd, shell_envp.data(), value)) {
+      line += value;
+    }
+  }
+  return line;
+}
+
+// Columns taken by `s` on screen, not counting escape sequences.
+size_t visible_width(string_view s) {
+  size_t width = 0;
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '\033') {
+      while (i + 1 < s.size() && !isalpha(static_cast<unsigned char>(s[i + 1])))
+        i++;
+      i++;
+    } else {
+      width++;
+    }
+  }
+  return width;
+}
+
+// Prints the prompt and asks the worker to refresh the slow segments.
+void draw_prompt() {
+  if (prompt_worker) {
+    char buf[64];
+    while (read(prompt_worker->notify[0], buf, sizeof buf) > 0)
+      ;
+    {
+      lock_guard<mutex> guard(prompt_worker->lock);
+      prompt_worker->pending = true;
+      prompt_worker->dir = shell_pwd;
+      prompt_worker->env.clear();
+      for (char **e = shell_envp.data(); *e; e++)
+        prompt_worker->env.emplace_back(*e);
+    }
+    prompt_worker->wake.notify_one();
+  }
+  prompt_shown = prompt_segment_line();
+  prompt_above = true;
+  cout << prompt_shown << "\n" PROMPT << flush;
+}
+
+// Rewrites the segment line above the input if a slow segment changed.
+// Only done while that line fits on one row, so the rows below it stay
+// where the line editor thinks they are.
+void redraw_prompt(const LineView &view, string &out) {
+  string line = prompt_segment_line();
+  if (!prompt_above || line == prompt_shown ||
+      visible_width(line) >= view.cols ||
+      visible_width(prompt_shown) >= view.cols)
+    return;
+  size_t rows = (view.prompt_width + view.cursor) / view.cols + 1;
+  out += "\0337\033[" + to_string(rows) + "A\r" + line + "\033[K\0338";
+  prompt_shown = line;
+}
+
+// Directory reads for Tab run on this thread, so a huge or slow directory
+// never blocks the editor. Every request gets a generation; asking for
+// something else, or typing on, moves `wanted` past it, which makes the
+// read give up between getdents64() calls and a late result be dropped.
+// When no listing is waiting, the thread also keeps the history's Ctrl-R
+// index up to date.
+struct CompletionWorker {
+  mutex lock;
+  condition_variable wake;
+  string dir;            // absolute directory to list
+  uint64_t requested = 0; // generation of `dir`
+  shared_ptr<const DirListing> result;
+  uint64_t result_gen = 0;
+  atomic<uint64_t> wanted{0};
+  int notify[2] = {-1, -1}; // a byte means a result is ready
+
+  bool history_wanted = false;
+  size_t history_end = 0;     // index the records up to this file offset
+  uint64_t history_epoch = 0; // of the file the request is for
+  shared_ptr<const HistoryIndex> history_index; // newest finished
+  uint64_t history_index_epoch = 0;
+};
+
+CompletionWorker *completion_worker = nullptr;
+
+void completion_worker_loop(CompletionWorker *w) {
+  uint64_t done = 0;
+  while (true) {
+    string dir;
+    uint64_t gen;
+    {
+      unique_lock<mutex> guard(w->lock);
+      w->wake.wait(guard,
+                   [&] { return w->requested != done || w->history_wanted; });
+      if (w->requested == done) {
+        w->history_wanted = false;
+        size_t end = w->history_end;
+        uint64_t epoch = w->history_epoch;
+        shared_ptr<const HistoryIndex> base;
+        if (w->history_index_epoch == epoch)
+          base = w->history_index;
+        guard.unlock();
+        auto next = extend_history_index(base.get(), history.fd, end);
+        guard.lock();
+        if (next) {
+          w->history_index = next;
+          w->history_index_epoch = epoch;
+        }
+        continue;
+      }
+      dir = w->dir;
+      gen = done = w->requested;
+    }
+    auto listing = list_dir(dir, &w->wanted, gen);
+    if (w->wanted != gen)
+      continue;
+    {
+      lock_guard<mutex> guard(w->lock);
+      w->result = listing;
+      w->result_gen = gen;
+    }
+    char byte = 0;
+    [[maybe_unused]] ssize_t n = write(w->notify[1], &byte, 1);
+  }
+}
+
+void init_completion() {
+  auto *w = new CompletionWorker;
+  if (pipe2(w->notify, O_CLOEXEC | O_NONBLOCK) != 0) {
+    delete w;
+    return;
+  }
+  // A fork() while this thread holds the listing cache lock would leave the
+  // child's copy locked for good, and its globs take it. Holding the lock
+  // across every fork() hands the child a whole cache and a free lock.
+  pthread_atfork([] { listing_cache.lock.lock(); },
+                 [] { listing_cache.lock.unlock(); },
+                 [] { listing_cache.lock.unlock(); });
+  completion_worker = w;
+  thread(completion_worker_loop, w).detach();
+}
+
+// Asks for `dir` to be listed and returns the request's generation.
+uint64_t request_listing(const string &dir) {
+  CompletionWorker *w = completion_worker;
+  lock_guard<mutex> guard(w->lock);
+  w->dir = dir;
+  w->wanted = ++w->requested;
+  w->wake.notify_one();
+  return w->requested;
+}
+
+void cancel_listing() {
+  if (completion_worker)
+    completion_worker->wanted = 0;
+}
+
+// Takes the result of request `gen` if it has arrived: the listing, or
+// null when the directory could not be read.
+bool take_listing(uint64_t gen, shared_ptr<const DirListing> &listing) {
+  CompletionWorker *w = completion_worker;
+  char buf[64];
+  while (read(w->notify[0], buf, sizeof buf) > 0)
+    ;
+  lock_guard<mutex> guard(w->lock);
+  if (w->result_gen != gen)
+    return false;
+  w->result_gen = 0;
+  listing = move(w->result);
+  return true;
+}
+
+// Asks the completion thread to index the history up to its current end.
+void request_history_index() {
+  CompletionWorker *w = completion_worker;
+  if (!w || history.fd == -1)
+    return;
+  lock_guard<mutex> guard(w->lock);
+  w->history_wanted = true;
+  w->history_end = history.valid_end;
+  w->history_epoch = history.epoch;
+  w->wake.notify_one();
+}
+
+// Lists records added since the last call and takes the newest index the
+// completion thread has finished; once enough records are past it, asks
+// for those to be indexed too.
+void history_index() {
+  history.offsets_end =
+      list_records(history.map, history.mapped, history.offsets_end,
+                   history.valid_end, history.offsets);
+  if (CompletionWorker *w = completion_worker) {
+    lock_guard<mutex> guard(w->lock);
+    if (w->history_index && w->history_index_epoch == history.epoch &&
+        w->history_index->records <= history.offsets.size())
+      history.index = w->history_index;
+  }
+  size_t indexed = history.index ? history.index->records : 0;
+  if (history.offsets.size() - indexed >= 4096)
+    request_history_index();
+}
+
+// The word Tab completes: input[start, end) with end at the cursor, and
+// whether it is in command position, where it names a program rather
+// than a file.
+struct CompletionWord {
+  size_t start = 0, end = 0;
+  bool command = false;
+};
+
+bool word_break(char ch) {
+  return isspace(static_cast<unsigned char>(ch)) || ch == '|' || ch == '&' ||
+         ch == ';' || ch == '(' || ch == ')' || ch == '<' || ch == '>';
+}
+
+CompletionWord completion_word(const string &input, size_t cursor) {
+  CompletionWord w;
+  w.start = w.end = cursor;
+  while (w.start > 0 && !word_break(input[w.start - 1]))
+    w.start--;
+  // A command starts the line, follows an operator, or follows `time` or
+  // `{`; after a redirection or an argument comes a file.
+  size_t end = w.start;
+  while (end > 0 && isspace(static_cast<unsigned char>(input[end - 1])))
+    end--;
+  size_t begin = end;
+  while (begin > 0 && !word_break(input[begin - 1]))
+    begin--;
+  string_view prev = string_view(input).substr(begin, end - begin);
+  if (!prev.empty()) {
+    w.command = prev == "time" || prev == "{";
+  } else {
+    char ch = end > 0 ? input[end - 1] : '\0';
+    w.command = ch == '\0' || ch == '|' || ch == '&' || ch == ';' || ch == '(';
+  }
+  return w;
+}
+
+// A path completion waiting for its listing. Any key but Tab cancels it,
+// so the line is still as it was when Tab was pressed.
+struct PathCompletion {
+  uint64_t gen = 0; // 0 when nothing is pending
+  CompletionWord word;
+  string dir_part; // the word up to and including its last '/'
+  string dir;      // that directory, absolute
+};
+
+// Where the directory part of a word to complete lives; `~/` is $HOME.
+string completion_dir(const string &dir_part) {
+  if (dir_part.compare(0, 2, "~/") == 0) {
+    const char *home = get_var("HOME");
+    return absolute_dir(string(home ? home : "") + dir_part.substr(1));
+  }
+  return absolute_dir(dir_part);
+}
+
+// At most this many candidates are listed under the line.
+const size_t completion_list_max = 200;
+
+// Candidates for the last part of a path, sorted, with a '/' after
+// directories. Dotfiles only when the part starts with a dot.
+vector<string> path_candidates(const DirListing &listing, const string &dir,
+                               string_view base) {
+  vector<string> out;
+  bool dot = !base.empty() && base[0] == '.';
+  for (const DirEntry &e : listing.entries) {
+    string_view name = listing.name(e);
+    if (name.compare(0, base.size(), base) != 0 || (name[0] == '.' && !dot))
+      continue;
+    out.emplace_back(name);
+    if (entry_is_dir(e, dir + "/" + out.back()))
+      out.back() += '/';
+  }
+  sort(out.begin(), out.end());
+  return out;
+}
+
+// Blocks until a key can be read, redrawing the prompt whenever the worker
+// reports a new segment value in the meantime. Returns true instead if the
+// listing for completion request `gen` arrives first.
+bool wait_for_key(const LineView &view, string &out, uint64_t gen,
+                  shared_ptr<const DirListing> &listing) {
+  if (term_input.buffered())
+    return false;
+  while (true) {
+    struct pollfd pfd[3] = {{STDIN_FILENO, POLLIN, 0},
+                            {-1, POLLIN, 0},
+                            {-1, POLLIN, 0}};
+    if (prompt_worker)
+      pfd[1].fd = prompt_worker->notify[0];
+    if (gen)
+      pfd[2].fd = completion_worker->notify[0];
+    if (poll(pfd, 3, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (pfd[1].revents & POLLIN) {
+      char buf[64];
+      while (read(prompt_worker->notify[0], buf, sizeof buf) > 0)
+        ;
+      redraw_prompt(view, out);
+      write_pending(out);
+    }
+    if ((pfd[2].revents & POLLIN) && take_listing(gen, listing))
+      return true;
+    if (pfd[0].revents)
+      return false;
+  }
+}
+
+// Ctrl-R: incremental search through history on the prompt line. Returns
+// true when Enter accepted the match, which is left in `input`; any other
+// key leaves the match in `input` for editing, and Ctrl-G restores the
+// line as it was.
+bool reverse_search(LineView &view, string &input, size_t &cursor,
+                    string &out, struct termios &org_ter) {
+  history_sync();
+  history_index();
+  size_t newest = history.offsets.size();
+  string query;
+  ssize_t found = -1;
+  bool failed = false;
+  size_t drawn = 0; // length of the search line on screen
+
+  auto erase_drawn = [&]() {
+    size_t rows = drawn > 0 ? (drawn - 1) / view.cols : 0;
+    if (rows > 0)
+      out += "\033[" + to_string(rows) + "A";
+    out += "\r\033[J";
+  };
+  // Moving to an older match steps past copies of the line already shown.
+  auto search = [&](size_t before, bool older = false) {
+    ssize_t hit = history_search(query, before);
+    if (older && found >= 0) {
+      string_view shown = history_entry(history.offsets[found]);
+      while (hit >= 0 && history_entry(history.offsets[hit]) == shown)
+        hit = history_search(query, hit);
+    }
+    failed = hit < 0;
+    if (!failed)
+      found = hit;
+  };
+
+  move_cursor(out, view, view.prompt_width + view.cursor, 0);
+  bool accepted = false;
+  while (true) {
+    if (!input_pending()) {
+      erase_drawn();
+      string line = failed ? "(failed reverse-i-search)`"
+                           : "(reverse-i-search)`";
+      line += query;
+      line += "': ";
+      if (found >= 0)
+        line += history_entry(history.offsets[found]);
+      out += line;
+      drawn = line.size();
+      write_pending(out);
+    }
+    Key key = read_key(org_ter);
+    if (key.type == KeyType::Text) {
+      query += key.text;
+      search(found >= 0 ? found + 1 : newest);
+    } else if (key.type == KeyType::Backspace) {
+      if (!query.empty())
+        query.pop_back();
+      found = -1;
+      if (!query.empty())
+        search(newest);
+      else
+        failed = false;
+    } else if (key.type == KeyType::Search) {
+      if (!query.empty())
+        search(found >= 0 ? found : newest, true);
+    } else if (key.type == KeyType::Cancel) {
+      found = -1;
+      break;
+    } else {
+      accepted = key.type == KeyType::Enter;
+      if (found >= 0) {
+        input = string(history_entry(history.offsets[found]));
+        cursor = input.size();
+      }
+      break;
+    }
+  }
+  erase_drawn();
+  out += PROMPT;
+  view.shown.clear();
+  view.cursor = 0;
+  return accepted;
+}
+
+string read_input() {
+  string input;
+  size_t cursor = 0;
+  struct termios org_ter;
+  enableRawMode(org_ter);
+
+  LineView view;
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+    view.cols = ws.ws_col;
+  // Bracketed paste: the terminal wraps pasted text in markers, so a paste
+  // arrives as one Text key instead of a stream of keystrokes.
+  string out = "\033[?2004h";
+  cout.flush();
+
+  // Up/Down position: the start of the record shown; the end of the file
+  // while the line being typed is shown.
+  history_sync();
+  size_t hist_pos = history.valid_end;
+  string edited;
+
+  // Replaces the word being completed.
+  auto complete = [&](const CompletionWord &word, const string &text) {
+    input.replace(word.start, word.end - word.start, text);
+    cursor = word.start + text.size();
+  };
+  // Lists the candidates below the line and starts a new prompt.
+  auto show_candidates = [&](auto first, auto last, size_t count) {
+    render_line(view, input, input.size(), out);
+    out += '\n';
+    size_t shown = 0;
+    for (auto it = first; it != last && shown < completion_list_max;
+         ++it, ++shown) {
+      out += *it;
+      out += ' ';
+    }
+    if (count > shown)
+      out += "\n... and " + to_string(count - shown) + " more";
+    out += "\n" PROMPT;
+    prompt_above = false;
+    view.shown.clear();
+    view.cursor = 0;
+  };
+  PathCompletion pending;
+  auto finish_path = [&](const DirListing &listing) {
+    const CompletionWord &word = pending.word;
+    string_view base = string_view(input).substr(
+        word.start + pending.dir_part.size(),
+        word.end - word.start - pending.dir_part.size());
+    vector<string> found = path_candidates(listing, pending.dir, base);
+    if (found.empty())
+      return;
+    if (found.size() == 1) {
+      string &name = found[0];
+      complete(word, pending.dir_part + name + (name.back() == '/' ? "" : " "));
+      return;
+    }
+    const string &a = found.front(), &b = found.back();
+    size_t n = base.size();
+    while (n < a.size() && n < b.size() && a[n] == b[n])
+      n++;
+    if (n > base.size())
+      complete(word, pending.dir_part + a.substr(0, n));
+    else
+      show_candidates(found.begin(), found.end(), found.size());
+  };
+
+  bool accepted = false;
+  while (!accepted) {
+    // Redraw once per burst of input rather than once per key.
+    if (!input_pending()) {
+      render_line(view, input, cursor, out);
+      write_pending(out);
+      shared_ptr<const DirListing> listing;
+      if (wait_for_key(view, out, pending.gen, listing)) {
+        pending.gen = 0;
+        if (listing)
+          finish_path(*listing);
+        continue;
+      }
+    }
+    Key key = read_key(org_ter);
+    // Anything but another Tab means the pending completion is not wanted.
+    if (pending.gen && key.type != KeyType::Tab) {
+      cancel_listing();
+      pending.gen = 0;
+    }
+    switch (key.type) {
+    case KeyType::Text:
+      input.insert(cursor, key.text);
+      cursor += key.text.size();
+      break;
+    case KeyType::Right:
+      if (cursor < input.size())
+        cursor++;
+      break;
+    case KeyType::Left:
+      if (cursor > 0)
+        cursor--;
+      break;
+    case KeyType::Home:
+      cursor = 0;
+      break;
+    case KeyType::End:
+      cursor = input.size();
+      break;
+    case KeyType::Backspace:
+      if (cursor > 0) {
+        input.erase(cursor - 1, 1);
+        cursor--;
+      }
+      break;
+    case KeyType::Delete:
+      if (cursor < input.size())
+        input.erase(cursor, 1);
+      break;
+    case KeyType::Tab: {
+      if (pending.gen)
+        break;
+      CompletionWord word = completion_word(input, cursor);
+      string text = input.substr(word.start, word.end - word.start);
+      if (word.command && text.find('/') == string::npos) {
+        if (text.empty())
+          break;
+        Matches matches = get_matches(text);
+        if (matches.empty())
+          break;
+        if (matches.size() == 1)
+          complete(word, *matches.first + " ");
+        else if (matches.lcp.size() != text.size())
+          complete(word, string(matches.lcp));
+        else
+          show_candidates(matches.first, matches.last, matches.size());
+        break;
+      }
+      size_t slash = text.rfind('/');
+      pending.word = word;
+      pending.dir_part = slash == string::npos ? "" : text.substr(0, slash + 1);
+      pending.dir = completion_dir(pending.dir_part);
+      if (completion_worker) {
+        pending.gen = request_listing(pending.dir);
+      } else if (auto listing = list_dir(pending.dir)) {
+        finish_path(*listing);
+      }
+      break;
+    }
+    case KeyType::Up: {
+      ssize_t prev = history_prev(hist_pos);
+      if (prev < 0)
+        break;
+      if (hist_pos == history.valid_end)
+        edited = input;
+      hist_pos = prev;
+      input = string(history_entry(prev));
+      cursor = input.size();
+      break;
+    }
+    case KeyType::Down: {
+      if (hist_pos >= history.valid_end)
+        break;
+      ssize_t len = history_record_at(hist_pos);
+      hist_pos = len < 0 ? history.valid_end : hist_pos + history_frame + len;
+      if (hist_pos >= history.valid_end) {
+        hist_pos = history.valid_end;
+        input = edited;
+      } else {
+        input = string(history_entry(hist_pos));
+      }
+      cursor = input.size();
+      break;
+    }
+    case KeyType::Search:
+      accepted = reverse_search(view, input, cursor, out, org_ter);
+      break;
+    case KeyType::Enter:
+      accepted = true;
+      break;
+    case KeyType::Cancel:
+    case KeyType::Other:
+      break;
+    }
+  }
+  render_line(view, input, input.size(), out);
+  out += "\n\033[?2004l";
+  write_pending(out);
+  disableRawMode(org_ter);
+  return input;
+}
+
+// Splits `input` into tokens without allocating per word: the line is
+// copied into the arena once and quotes are removed in place, each word
+// getting a NUL after it so it can go into argv as it is.
+void tokenize(string_view input, Arena &arena, vector<Token> &tokens) {
+  tokens.clear();
+  char *buf = arena_copy(arena, input);
+  size_t w = 0, start = 0; // write position never passes the read position
+  Token current;
+  bool in_word = false;
+  bool in_quotes = false;
+  char quote_char = '\0';
+  bool quoted_glob = false;   // the word has a quoted *, ? or [
+  bool quoted_dollar = false; // and a $ in single quotes
+  auto is_glob = [](char ch) { return ch == '*' || ch == '?' || ch == '['; };
+
+  auto finish_word = [&](size_t r) {
+    if (in_word) {
+      current.text = string_view(buf + start, w - start);
+      current.end = r;
+      current.glob = current.glob && !quoted_glob;
+      current.vars = current.vars && !quoted_dollar;
+      if (!current.quoted)
+        current.bare = w - start;
+      buf[w++] = '\0';
+      tokens.push_back(current);
+    }
+    current = Token();
+    in_word = false;
+    quoted_glob = quoted_dollar = false;
+    start = w;
+  };
+  auto begin_word = [&](size_t r) {
+    if (!in_word)
+      current.begin = r;
+    in_word = true;
+  };
+
+  for (size_t r = 0; r < input.size(); r++) {
+    char ch = buf[r];
+    if (ch == '\'' || ch == '\"') {
+      if (!current.quoted)
+        current.bare = w - start;
+      if (in_quotes && ch == quote_char)
+        in_quotes = false;
+      else if (!in_quotes) {
+        in_quotes = true;
+        quote_char = ch;
+      } else
+        buf[w++] = ch;
+      current.quoted = true;
+      begin_word(r);
+    } else if (in_quotes) {
+      buf[w++] = ch;
+      quoted_glob = quoted_glob || is_glob(ch);
+      if (ch == '$' && quote_char == '"')
+        current.vars = true;
+      else if (ch == '$')
+        quoted_dollar = true;
+    } else if (isspace(ch)) {
+      finish_word(r);
+    } else if (ch == '&' && w > start && buf[w - 1] == '>' &&
+               !current.quoted) {
+      buf[w++] = ch; // 2>&1 is one word
+    } else if (ch == '|' || ch == '&' || ch == ';' || ch == '(' ||
+               ch == ')') {
+      finish_word(r);
+      Token op;
+      op.op = true;
+      op.begin = r;
+      bool doubled = (ch == '|' || ch == '&') && r + 1 < input.size() &&
+                     buf[r + 1] == ch;
+      if (ch == '|')
+        op.text = doubled ? "||" : "|";
+      else if (ch == '&')
+        op.text = doubled ? "&&" : "&";
+      else
+        op.text = ch == ';' ? ";" : ch == '(' ? "(" : ")";
+      r += doubled;
+      op.end = r + 1;
+      tokens.push_back(op);
+    } else {
+      buf[w++] = ch;
+      current.glob = current.glob || is_glob(ch);
+      current.vars = current.vars || ch == '$';
+      begin_word(r);
+    }
+  }
+  finish_word(input.size());
+}
+
+// A redirection operator at the start of a word, where it has to be
+// unquoted: `>`, `>>`, `<`, `<<`, `<<-` and `<<<`, optionally after the fd
+// they apply to, and `2>&1` or `1>&2` as whole words. The target is the
+// rest of the word, or else the next word.
+enum class RedirectOp : uint8_t {
+  None,
+  Out,
+  Append,
+  Dup,
+  In, // and the rest read stdin
+  Heredoc,
+  HereString,
+};
+
+struct RedirectWord {
+  RedirectOp op = RedirectOp::None;
+  int fd = -1;
+  int source = -1;         // Dup: the fd copied
+  size_t len = 0;          // of the operator
+  bool strip_tabs = false; // <<-
+};
+
+RedirectWord redirect_word(const Token &tok) {
+  RedirectWord r;
+  if (tok.op)
+    return r;
+  string_view s = tok.text.substr(0, tok.bare);
+  size_t i = s.size() > 1 && s[0] >= '0' && s[0] <= '2' ? 1 : 0;
+  int fd = i ? s[0] - '0' : -1;
+  string_view rest = s.substr(i);
+  auto starts = [&](string_view op) { return rest.substr(0, op.size()) == op; };
+
+  if (starts(">&")) {
+    if (s.size() != i + 3 || s.size() != tok.text.size())
+      return r;
+    r.op = RedirectOp::Dup;
+    r.source = s[i + 2] - '0';
+    r.len = s.size();
+    if (r.source != 1 && r.source != 2)
+      return RedirectWord();
+  } else if (starts(">")) {
+    r.op = starts(">>") ? RedirectOp::Append : RedirectOp::Out;
+    r.len = i + (r.op == RedirectOp::Append ? 2 : 1);
+  } else if (starts("<<<")) {
+    r.op = RedirectOp::HereString;
+    r.len = i + 3;
+  } else if (starts("<<")) {
+    r.op = RedirectOp::Heredoc;
+    r.strip_tabs = starts("<<-");
+    r.len = i + (r.strip_tabs ? 3 : 2);
+  } else if (starts("<")) {
+    r.op = RedirectOp::In;
+    r.len = i + 1;
+  } else {
+    return r;
+  }
+  bool input = r.op >= RedirectOp::In;
+  r.fd = fd != -1 ? fd : input ? 0 : 1;
+  if (input != (r.fd == 0) || r.fd == r.source)
+    return RedirectWord();
+  return r;
+}
+
+// Here-documents: `<<WORD` feeds the command the lines after its own, up
+// to one that is exactly WORD; `<<-` strips their leading tabs. Finds the
+// bodies the words `tokens` open, in order, in `rest`, the text after the
+// command line. Returns false when `rest` ends first, leaving what there
+// was of the last body.
+bool read_heredocs(const vector<Token> &tokens, string_view rest,
+                   Arena &arena, vector<string_view> &docs) {
+  docs.clear();
+  for (size_t i = 0; i < tokens.size(); i++) {
+    RedirectWord r = redirect_word(tokens[i]);
+    if (r.op == RedirectOp::None || r.op == RedirectOp::Dup)
+      continue;
+    string_view delim = tokens[i].text.substr(r.len);
+    if (delim.empty()) {
+      if (i + 1 == tokens.size() || tokens[i + 1].op)
+        continue; // a syntax error for the parser to report
+      delim = tokens[++i].text;
+    }
+    if (r.op != RedirectOp::Heredoc)
+      continue;
+    string body;
+    bool closed = false;
+    while (!rest.empty() && !closed) {
+      size_t nl = rest.find('\n');
+      string_view line = rest.substr(0, nl);
+      rest = nl == string_view::npos ? "" : rest.substr(nl + 1);
+      if (r.strip_tabs)
+        line.remove_prefix(min(line.find_first_not_of('\t'), line.size()));
+      closed = line == delim;
+      if (!closed) {
+        body += line;
+        body += '\n';
+      }
+    }
+    docs.push_back(arena_copy(arena, body));
+    if (!closed)
+      return false;
+  }
+  return true;
+}
+
+// Recursive descent over the tokens of one line:
+//
+//   list     := and_or ((';' | '&') and_or)* [';' | '&']
+//   and_or   := pipeline (('&&' | '||') pipeline)*
+//   pipeline := ['time'] command ('|' command)*
+//   command  := '(' list ')' redirect* | '{' list '}' redirect* | simple
+//
+// `{` and `}` are words, recognised only where a command starts, so as in
+// sh the list in a group has to end with `;` before the `}`.
+struct Parser {
+  Ast &ast;
+  const vector<Token> &tokens;
+  const vector<string_view> &docs; // here-document bodies, in order
+  size_t pos = 0;
+  size_t next_doc = 0;
+  bool failed = false;
+};
+
+bool at_op(const Parser &p, string_view op) {
+  return p.pos < p.tokens.size() && p.tokens[p.pos].op &&
+         p.tokens[p.pos].text == op;
+}
+
+bool at_word(const Parser &p, string_view word) {
+  return p.pos < p.tokens.size() && !p.tokens[p.pos].op &&
+         !p.tokens[p.pos].quoted && p.tokens[p.pos].text == word;
+}
+
+void syntax_error(Parser &p) {
+  if (p.failed)
+    return;
+  p.failed = true;
+  string_view near =
+      p.pos < p.tokens.size() ? p.tokens[p.pos].text : "newline";
+  cerr << "fero: syntax error near `" << near << "'\n";
+}
+
+// `fd> file`: the fd gets its own file. If the other output was sharing
+// the file it had, that one keeps it.
+void redirect_output(Command &cmd, int fd, const Token &target,
+                     bool append) {
+  OutputRedirect &to = fd == STDOUT_FILENO ? cmd.stdout_to : cmd.stderr_to;
+  OutputRedirect &other = fd == STDOUT_FILENO ? cmd.stderr_to : cmd.stdout_to;
+  if (other.dup == DupFrom::Target)
+    other = to;
+  to.file = target.text;
+  to.append = append;
+  to.expand = target.vars;
+  to.dup = DupFrom::None;
+}
+
+// `fd>&source`: the fd becomes whatever the other output is right now.
+void redirect_dup(Command &cmd, int fd) {
+  OutputRedirect &to = fd == STDOUT_FILENO ? cmd.stdout_to : cmd.stderr_to;
+  OutputRedirect &other = fd == STDOUT_FILENO ? cmd.stderr_to : cmd.stdout_to;
+  if (other.dup == DupFrom::Target)
+    return; // already sharing its file
+  if (other.dup == DupFrom::Original) {
+    to = OutputRedirect(); // a copy of our own original
+    return;
+  }
+  to = OutputRedirect();
+  to.dup = other.file.empty() ? DupFrom::Original : DupFrom::Target;
+}
+
+// If tokens[i] is a redirection, records it in `cmd`, steps `i` over its
+// target and returns true.
+bool parse_redirect(Parser &p, size_t &i, size_t end, Command &cmd) {
+  const Token &tok = p.tokens[i];
+  RedirectWord r = redirect_word(tok);
+  if (r.op == RedirectOp::None)
+    return false;
+  if (r.op == RedirectOp::Dup) {
+    redirect_dup(cmd, r.fd);
+    return true;
+  }
+  Token target = tok;
+  target.text = tok.text.substr(r.len);
+  if (target.text.empty()) {
+    if (i + 1 >= end) {
+      syntax_error(p);
+      return true;
+    }
+    target = p.tokens[++i];
+  }
+
+  switch (r.op) {
+  case RedirectOp::Out:
+  case RedirectOp::Append:
+    redirect_output(cmd, r.fd, target, r.op == RedirectOp::Append);
+    break;
+  case RedirectOp::In:
+    cmd.stdin_file = target.text;
+    cmd.stdin_text = false;
+    cmd.expand_stdin = target.vars;
+    break;
+  case RedirectOp::HereString:
+    cmd.stdin_file = arena_copy(p.ast.arena, string(target.text) + "\n");
+    cmd.stdin_text = true;
+    cmd.expand_stdin = target.vars;
+    break;
+  case RedirectOp::Heredoc: {
+    // A quoted delimiter keeps the body as it is.
+    string_view body =
+        p.next_doc < p.docs.size() ? p.docs[p.next_doc++] : "";
+    cmd.stdin_file = body;
+    cmd.stdin_text = true;
+    cmd.expand_stdin =
+        !target.quoted && body.find('$') != string_view::npos;
+    break;
+  }
+  default:
+    break;
+  }
+  cmd.redirect_stdin = cmd.redirect_stdin || r.fd == STDIN_FILENO;
+  return true;
+}
+
+// A simple command from the words tokens[begin, end).
+Command parse_cmd(Parser &p, size_t begin, size_t end) {
+  const vector<Token> &tokens = p.tokens;
+  Arena &arena = p.ast.arena;
+  Command cmd;
+  cmd.args.argv = static_cast<char **>(
+      arena_alloc(arena, (end - begin + 1) * sizeof(char *)));
+  uint8_t *expand = nullptr;
+  for (size_t i = begin; i < end; i++) {
+    if (parse_redirect(p, i, end, cmd))
+      continue;
+    const Token &tok = tokens[i];
+    uint8_t flags = (tok.vars ? expand_vars_flag : 0) |
+                    (tok.glob ? expand_glob_flag : 0) |
+                    (tok.vars && !tok.quoted ? expand_drop_flag : 0);
+    if (flags && !expand) {
+      expand = static_cast<uint8_t *>(arena_alloc(arena, end - begin, 1));
+      fill(expand, expand + (end - begin), 0);
+      cmd.expand = expand;
+    }
+    if (expand)
+      expand[cmd.args.argc] = flags;
+    // NAME=value words before the command name are assignments.
+    size_t eq = tok.text.find('=');
+    if (cmd.assigns == cmd.args.argc && eq != string_view::npos &&
+        valid_var_name(tok.text.substr(0, eq)))
+      cmd.assigns++;
+    cmd.args.argv[cmd.args.argc++] = const_cast<char *>(tok.text.data());
+  }
+  cmd.args.argv[cmd.args.argc] = nullptr;
+
+  return cmd;
+}
+
+// The source of tokens[first, p.pos).
+string_view source(const Parser &p, string_view line, size_t first) {
+  if (first >= p.pos)
+    return {};
+  size_t begin = p.tokens[first].begin;
+  return line.substr(begin, p.tokens[p.pos - 1].end - begin);
+}
+
+uint32_t add_node(Ast &ast, NodeKind kind, uint32_t a, uint32_t b,
+                  string_view text) {
+  ast.nodes.push_back(Node{kind, a, b, text});
+  return ast.nodes.size() - 1;
+}
+
+uint32_t parse_list(Parser &p, string_view line);
+
+bool parse_command(Parser &p, string_view line, Command &cmd) {
+  const vector<Token> &tokens = p.tokens;
+  bool subshell = at_op(p, "(");
+  if (subshell || at_word(p, "{")) {
+    p.pos++;
+    uint32_t body = parse_list(p, line);
+    if (p.failed)
+      return false;
+    if (subshell ? !at_op(p, ")") : !at_word(p, "}")) {
+      syntax_error(p);
+      return false;
+    }
+    p.pos++;
+    cmd.kind = subshell ? CommandKind::Subshell : CommandKind::Group;
+    cmd.body = body;
+    size_t end = p.pos;
+    while (end < tokens.size() && !tokens[end].op)
+      end++;
+    for (; p.pos < end; p.pos++) {
+      if (!parse_redirect(p, p.pos, end, cmd)) {
+        syntax_error(p);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  if (at_word(p, "}")) {
+    syntax_error(p);
+    return false;
+  }
+  size_t begin = p.pos;
+  while (p.pos < tokens.size() && !tokens[p.pos].op)
+    p.pos++;
+  if (begin < p.pos)
+    cmd = parse_cmd(p, begin, p.pos);
+  // Redirects alone are a command too: `> f` creates or truncates f.
+  bool redirects = cmd.redirect_stdin || !cmd.stdout_to.file.empty() ||
+                   !cmd.stderr_to.file.empty() ||
+                   cmd.stdout_to.dup != DupFrom::None ||
+                   cmd.stderr_to.dup != DupFrom::None;
+  if (cmd.args.empty() && !redirects) {
+    syntax_error(p);
+    return false;
+  }
+  return true;
+}
+
+uint32_t parse_pipeline(Parser &p, string_view line) {
+  Ast &ast = p.ast;
+  bool timed = at_word(p, "time") && p.pos + 1 < p.tokens.size() &&
+               (!p.tokens[p.pos + 1].op || p.tokens[p.pos + 1].text == "(");
+  if (timed)
+    p.pos++;
+  size_t first = p.pos;
+  size_t base = ast.stages.size(); // nested pipelines share the scratch
+  while (true) {
+    Command cmd;
+    if (!parse_command(p, line, cmd))
+      break;
+    ast.stages.push_back(cmd);
+    if (!at_op(p, "|"))
+      break;
+    p.pos++;
+  }
+  uint32_t cmd = ast.cmds.size();
+  ast.cmds.insert(ast.cmds.end(), ast.stages.begin() + base,
+                  ast.stages.end());
+  uint32_t n = ast.stages.size() - base;
+  ast.stages.resize(base);
+  uint32_t node =
+      add_node(ast, NodeKind::Pipeline, cmd, n, source(p, line, first));
+  ast.nodes[node].timed = timed;
+  return node;
+}
+
+uint32_t parse_and_or(Parser &p, string_view line) {
+  size_t first = p.pos;
+  uint32_t node = parse_pipeline(p, line);
+  while (!p.failed && (at_op(p, "&&") || at_op(p, "||"))) {
+    NodeKind kind = at_op(p, "&&") ? NodeKind::And : NodeKind::Or;
+    p.pos++;
+    uint32_t rhs = parse_pipeline(p, line);
+    node = add_node(p.ast, kind, node, rhs, source(p, line, first));
+  }
+  return node;
+}
+
+uint32_t parse_list(Parser &p, string_view line) {
+  size_t first = p.pos;
+  uint32_t node = parse_and_or(p, line);
+  while (!p.failed && (at_op(p, ";") || at_op(p, "&"))) {
+    if (at_op(p, "&"))
+      node = add_node(p.ast, NodeKind::Async, node, 0,
+                      p.ast.nodes[node].text);
+    p.pos++;
+    if (p.pos == p.tokens.size() || at_op(p, ")") || at_word(p, "}"))
+      break;
+    uint32_t rhs = parse_and_or(p, line);
+    node = add_node(p.ast, NodeKind::Seq, node, rhs, source(p, line, first));
+  }
+  return node;
+}
+
+// Tokenizes `input` into `ast`, and when its first line opens
+// here-documents, reads their bodies from the lines after it.
+void tokenize_line(string_view input, Ast &ast) {
+  size_t nl = input.find('\n');
+  string_view first = input.substr(0, nl);
+  if (nl != string_view::npos && first.find("<<") != string_view::npos) {
+    tokenize(first, ast.arena, ast.tokens);
+    read_heredocs(ast.tokens, input.substr(nl + 1), ast.arena, ast.docs);
+    if (!ast.docs.empty())
+      return;
+  }
+  tokenize(input, ast.arena, ast.tokens);
+  ast.docs.clear();
+}
+
+// Whether the first line of `text` opens here-documents that the rest
+// doesn't finish, so the caller has to read more lines before running it.
+bool heredoc_open(string_view text) {
+  size_t nl = text.find('\n');
+  if (text.substr(0, nl).find("<<") == string_view::npos)
+    return false;
+  static Ast scratch;
+  arena_reset(scratch.arena);
+  tokenize(text.substr(0, nl), scratch.arena, scratch.tokens);
+  string_view rest = nl == string_view::npos ? "" : text.substr(nl + 1);
+  return !read_heredocs(scratch.tokens, rest, scratch.arena, scratch.docs);
+}
+
+// Parses a whole line into `ast`, reusing its memory. Returns false after
+// reporting a syntax error; an empty line gives an empty Ast.
+bool parse_line(string_view input, Ast &ast) {
+  arena_reset(ast.arena);
+  ast.nodes.clear();
+  ast.cmds.clear();
+  ast.stages.clear();
+  tokenize_line(input, ast);
+  if (ast.tokens.empty())
+    return true;
+
+  string_view line = arena_copy(ast.arena, input);
+  Parser p{ast, ast.tokens, ast.docs};
+  ast.root = parse_list(p, line);
+  if (!p.failed && p.pos < ast.tokens.size())
+    syntax_error(p);
+  if (p.failed) {
+    ast.nodes.clear();
+    ast.cmds.clear();
+    return false;
+  }
+  return true;
+}
+
+// Lines parsed recently, most recently used first, so a line that comes
+// round again (the body of a script loop, a command recalled from
+// history) runs from its cached Ast without being parsed. Entries are
+// found by a hash of the line; evicted ones are refilled in place, so the
+// arena and vectors of their Asts are reused as well.
+struct ParseCacheEntry {
+  size_t hash = 0;
+  string line;
+  Ast ast;
+};
+
+struct ParseCache {
+  list<ParseCacheEntry> lru;
+  unordered_map<size_t, list<ParseCacheEntry>::iterator> index;
+  size_t limit = 512; // 0 turns the cache off
+  uint64_t hits = 0, misses = 0;
+};
+
+ParseCache parse_cache;
+
+// Drops the least recently used entries beyond `keep`, but never the
+// first: that is the line running now, maybe `parsecache` itself.
+void trim_parse_cache(size_t keep) {
+  ParseCache &cache = parse_cache;
+  while (cache.lru.size() > max<size_t>(keep, 1)) {
+    cache.index.erase(cache.lru.back().hash);
+    cache.lru.pop_back();
+  }
+}
+
+// The Ast for `input`, from the cache or freshly parsed into it; nullptr
+// after a syntax error, which is reported every time and never cached.
+const Ast *parse_cached(string_view input) {
+  ParseCache &cache = parse_cache;
+  if (cache.limit == 0) {
+    cache.lru.clear();
+    cache.index.clear();
+    static Ast ast;
+    return parse_line(input, ast) ? &ast : nullptr;
+  }
+  size_t hash = std::hash<string_view>{}(input);
+  auto it = cache.index.find(hash);
+  if (it != cache.index.end() && it->second->line == input) {
+    cache.hits++;
+    cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+    return &cache.lru.front().ast;
+  }
+  cache.misses++;
+
+  // A line with the same hash gives up its entry; otherwise the least
+  // recently used one is refilled once the cache is full.
+  list<ParseCacheEntry>::iterator entry;
+  if (it != cache.index.end()) {
+    entry = it->second;
+  } else if (cache.lru.size() >= cache.limit) {
+    entry = prev(cache.lru.end());
+    cache.index.erase(entry->hash);
+  } else {
+    entry = cache.lru.emplace(cache.lru.begin());
+  }
+  cache.lru.splice(cache.lru.begin(), cache.lru, entry);
+  if (!parse_line(input, entry->ast)) {
+    if (it != cache.index.end())
+      cache.index.erase(it);
+    cache.lru.erase(entry);
+    return nullptr;
+  }
+  entry->hash = hash;
+  entry->line.assign(input);
+  cache.index[hash] = entry;
+  return &entry->ast;
+}
+
+bool is_builtin(string_view name);
+
+int builtin_fg(const Command &cmd, Sink &out, Sink &err);
+int builtin_kill(const Command &cmd, Sink &out, Sink &err);
+int builtin_bg(const Command &cmd, Sink &out, Sink &err);
+int builtin_jobs(const Command &cmd, Sink &out, Sink &err);
+int builtin_wait(const Command &cmd, Sink &out, Sink &err);
+int builtin_par(const Command &cmd, Sink &out, Sink &err);
+
+// Every builtin takes its command and sinks and returns its status; the
+// status of the previous command is still in last_status while it runs.
+int builtin_exit(const Command &cmd, Sink &out, Sink &err) {
+  int code = last_status;
+  if (cmd.args.size() >= 2) {
+    try {
+      code = stoi(string(cmd.args[1])) & 0xff;
+    } catch (const exception &) {
+      err << "exit: " << cmd.args[1] << ": numeric argument required\n";
+      code = 2;
+    }
+  }
+  sink_close(out);
+  sink_close(err);
+  exit(code);
+}
+
+int builtin_cd(const Command &cmd, Sink &, Sink &err) {
+  string_view target;
+  if (cmd.args.size() >= 2 && !cmd.args[1].empty() && cmd.args[1] != "~")
+    target = cmd.args[1];
+  else if (const char *home = get_var("HOME"))
+    target = home;
+  else
+    target = "/";
+  string cdpath = logical_path(shell_pwd, target);
+
+  if (chdir(cdpath.c_str()) != 0) {
+    err << "cd: " << target << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+  set_pwd(cdpath);
+  return 0;
+}
+
+int builtin_clear(const Command &, Sink &out, Sink &) {
+  out << "\033[2J\033[H";
+  return 0;
+}
+
+int builtin_pwd(const Command &cmd, Sink &out, Sink &err) {
+  // -P asks the kernel, resolving symlinks; otherwise the logical path.
+  char buf[PATH_MAX];
+  if (cmd.args.size() < 2 || cmd.args[1] != "-P") {
+    out << shell_pwd << "\n";
+  } else if (getcwd(buf, sizeof buf)) {
+    out << buf << "\n";
+  } else {
+    err << "pwd: " << strerror(errno) << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+int builtin_type(const Command &cmd, Sink &out, Sink &err) {
+  if (cmd.args.size() < 2) {
+    out << "[Usage]: " << cmd.args[0] << " <Command>\n";
+    return 0;
+  }
+  string_view query = cmd.args[1];
+  if (is_builtin(query)) {
+    out << GREEN << query << RESET << DGREEN << ": is a shell builtin\n"
+        << RESET;
+  } else if (const string *fullpath = lookup_command(query)) {
+    out << query << ": is " << *fullpath << "\n";
+  } else {
+    err << query << ": not found\n";
+    return 1;
+  }
+  return 0;
+}
+
+int builtin_hash(const Command &cmd, Sink &out, Sink &err) {
+  int status = 0;
+  if (cmd.args.size() >= 2 && cmd.args[1] == "-r") {
+    command_hash.clear();
+  } else if (cmd.args.size() >= 2) {
+    for (size_t i = 1; i < cmd.args.size(); i++) {
+      string_view name = cmd.args[i];
+      if (name.find('/') != string::npos)
+        continue;
+      if (const string *path = lookup_command(name)) {
+        command_hash[string(name)] = HashedCommand{*path, 0};
+      } else {
+        err << "hash: " << name << ": not found\n";
+        status = 1;
+      }
+    }
+  } else if (command_hash.empty()) {
+    out << "hash: hash table empty\n";
+  } else {
+    vector<pair<string, const HashedCommand *>> entries;
+    for (const auto &entry : command_hash)
+      entries.emplace_back(entry.first, &entry.second);
+    sort(entries.begin(), entries.end());
+    out << "hits\tcommand\n";
+    for (const auto &entry : entries)
+      out << "   " << entry.second->hits << "\t" << entry.second->path << "\n";
+  }
+  return status;
+}
+
+int builtin_parsecache(const Command &cmd, Sink &out, Sink &err) {
+  ParseCache &cache = parse_cache;
+  if (cmd.args.size() >= 2 && cmd.args[1] == "-r") {
+    trim_parse_cache(0);
+    cache.hits = cache.misses = 0;
+  } else if (cmd.args.size() >= 3 && cmd.args[1] == "-s") {
+    try {
+      cache.limit = stoul(string(cmd.args[2]));
+      trim_parse_cache(cache.limit);
+    } catch (const exception &) {
+      err << "parsecache: " << cmd.args[2] << ": invalid size\n";
+      return 1;
+    }
+  } else if (cmd.args.size() >= 2) {
+    err << "[Usage]: parsecache [-r | -s <size>]\n";
+    return 2;
+  } else {
+    out << "hits\tmisses\tentries\tlimit\n"
+        << cache.hits << "\t" << cache.misses << "\t" << cache.lru.size()
+        << "\t" << cache.limit << "\n";
+  }
+  return 0;
+}
+
+// The counters behind `stats`, by name, in the order it lists them.
+vector<pair<string_view, uint64_t>> stats_counters() {
+  const Stats &s = stats;
+  return {
+      {"commands", s.builtins + s.externals + s.subshells},
+      {"builtins", s.builtins},
+      {"externals", s.externals},
+      {"subshells", s.subshells},
+      {"spawn_failures", s.spawn_failures},
+      {"hash_hits", s.hash_hits},
+      {"index_hits", s.index_hits},
+      {"path_searches", s.path_searches},
+      {"parse_cache_hits", parse_cache.hits},
+      {"parse_cache_misses", parse_cache.misses},
+      {"completions", s.completions},
+      {"sink_bytes", s.sink_bytes},
+      {"cat_bytes", s.cat_bytes},
+      {"heredoc_bytes", s.heredoc_bytes},
+  };
+}
+
+// One object; the histogram is keyed by each bucket's exclusive upper
+// bound in microseconds, "inf" for the last.
+string stats_json() {
+  string json = "{";
+  for (const auto &[name, value] : stats_counters())
+    json += "\"" + string(name) + "\": " + to_string(value) + ", ";
+  json += "\"completion_us\": {";
+  for (size_t i = 0; i < latency_buckets; i++) {
+    string bound = i + 1 < latency_buckets ? to_string(1 << i) : "inf";
+    json += (i ? ", \"" : "\"") + bound + "\": " +
+            to_string(stats.completion_us[i]);
+  }
+  return json + "}}\n";
+}
+
+void write_stats_file() {
+  if (stats_file.empty())
+    return;
+  int fd = open(stats_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  string json = stats_json();
+  if (fd == -1 || !write_all(fd, json.data(), json.size()))
+    perror(("fero: " + stats_file).c_str());
+  if (fd != -1)
+    close(fd);
+}
+
+// stats [-j | -r]: what this session has done so far, one counter a line
+// or as JSON; -r starts the counts again.
+int builtin_stats(const Command &cmd, Sink &out, Sink &err) {
+  if (cmd.args.size() >= 2 && cmd.args[1] == "-r") {
+    stats = Stats();
+    parse_cache.hits = parse_cache.misses = 0;
+  } else if (cmd.args.size() >= 2 && cmd.args[1] == "-j") {
+    out << stats_json();
+  } else if (cmd.args.size() >= 2) {
+    err << "[Usage]: stats [-j | -r]\n";
+    return 2;
+  } else {
+    for (const auto &[name, value] : stats_counters())
+      out << name << "\t" << value << "\n";
+    out << "completion_us";
+    for (size_t i = 0; i < latency_buckets; i++) {
+      if (stats.completion_us[i] == 0)
+        continue;
+      out << (i + 1 < latency_buckets ? "\t<" : "\t>=")
+          << (i + 1 < latency_buckets ? 1 << i : 1 << (i - 1)) << ":"
+          << stats.completion_us[i];
+    }
+    out << "\n";
+  }
+  return 0;
+}
+
+// What `set -o` and `set +o` switch.
+const pair<string_view, bool *> shell_options[] = {
+    {"pipefail", &opt_pipefail},
+    {"timing", &opt_timing},
+};
+
+// export [NAME[=value]...]: with no names, lists the environment.
+int builtin_export(const Command &cmd, Sink &out, Sink &err) {
+  if (cmd.args.size() < 2) {
+    vector<const char *> entries(shell_envp.begin(), shell_envp.end() - 1);
+    sort(entries.begin(), entries.end(),
+         [](const char *a, const char *b) { return strcmp(a, b) < 0; });
+    for (const char *e : entries) {
+      const char *eq = strchr(e, '=');
+      out << "export " << string_view(e, eq - e) << "=\"" << eq + 1
+          << "\"\n";
+    }
+    return 0;
+  }
+  int status = 0;
+  for (size_t i = 1; i < cmd.args.size(); i++) {
+    string_view arg = cmd.args[i];
+    size_t eq = arg.find('=');
+    string name(arg.substr(0, eq));
+    if (!valid_var_name(name)) {
+      err << "export: " << arg << ": not a valid identifier\n";
+      status = 1;
+    } else if (eq != string_view::npos) {
+      set_var(name, arg.substr(eq + 1), true);
+    } else {
+      export_var(name);
+    }
+  }
+  return status;
+}
+
+int builtin_unset(const Command &cmd, Sink &, Sink &) {
+  for (size_t i = 1; i < cmd.args.size(); i++)
+    unset_var(string(cmd.args[i]));
+  return 0;
+}
+
+int builtin_set(const Command &cmd, Sink &out, Sink &err) {
+  if (cmd.args.size() < 3) {
+    for (const auto &option : shell_options)
+      out << option.first << "\t" << (*option.second ? "on" : "off") << "\n";
+    return 0;
+  }
+  if (cmd.args[1] == "-o" || cmd.args[1] == "+o") {
+    for (const auto &option : shell_options) {
+      if (cmd.args[2] == option.first) {
+        *option.second = cmd.args[1] == "-o";
+        return 0;
+      }
+    }
+  }
+  err << "[Usage]: set -o|+o pipefail|timing\n";
+  return 2;
+}
+
+int builtin_echo(const Command &cmd, Sink &out, Sink &) {
+  for (size_t i = 1; i < cmd.args.size(); i++) {
+    out << cmd.args[i];
+    if (i != cmd.args.size() - 1)
+      out << ' ';
+  }
+  out << '\n';
+  return 0;
+}
+
+int builtin_cat(const Command &cmd, Sink &out, Sink &err) {
+  vector<string> files(cmd.args.begin() + 1, cmd.args.end());
+  if (files.empty())
+    files.push_back("-");
+  int status = 0;
+  for (const auto &file : files) {
+    int fd = file == "-" ? STDIN_FILENO : open(file.c_str(), O_RDONLY);
+    if (fd == -1) {
+      err << "cat: " << file << ": " << strerror(errno) << "\n";
+      status = 1;
+      continue;
+    }
+    sink_flush(out);
+    int out_fd = sink_fd(out);
+    ssize_t moved = out_fd != -1 ? transfer_fd(fd, out_fd) : 0;
+    if (moved < 0) {
+      err << "cat: " << file << ": " << strerror(errno) << "\n";
+      status = 1;
+    } else {
+      stats.cat_bytes += moved;
+    }
+    if (fd != STDIN_FILENO)
+      close(fd);
+  }
+  return status;
+}
+
+int builtin_true(const Command &, Sink &, Sink &) { return 0; }
+
+int builtin_false(const Command &, Sink &, Sink &) { return 1; }
+
+// test and [ evaluate in the shell, so a script condition costs no fork.
+// Precedence is the usual ! over -a over -o, with ( ) grouping; status 2
+// means the expression itself was malformed.
+struct TestExpr {
+  vector<string_view> words;
+  size_t pos = 0;
+  string error;
+};
+
+bool test_or(TestExpr &t);
+
+bool test_integer(TestExpr &t, string_view word, long long &value) {
+  string text(word);
+  char *end;
+  errno = 0;
+  value = strtoll(text.c_str(), &end, 10);
+  if (text.empty() || *end || errno) {
+    if (t.error.empty())
+      t.error = text + ": integer expression expected";
+    return false;
+  }
+  return true;
+}
+
+bool test_file(char op, const char *path) {
+  struct stat st;
+  if (op == 'L' || op == 'h')
+    return lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+  if (stat(path, &st) != 0)
+    return false;
+  switch (op) {
+  case 'e':
+    return true;
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 'p':
+    return S_ISFIFO(st.st_mode);
+  case 'S':
+    return S_ISSOCK(st.st_mode);
+  case 'b':
+    return S_ISBLK(st.st_mode);
+  case 'c':
+    return S_ISCHR(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  case 'r':
+    return access(path, R_OK) == 0;
+  case 'w':
+    return access(path, W_OK) == 0;
+  case 'x':
+    return access(path, X_OK) == 0;
+  }
+  return false;
+}
+
+bool is_test_binary(string_view op) {
+  for (string_view known :
+       {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge"}) {
+    if (op == known)
+      return true;
+  }
+  return false;
+}
+
+bool test_primary(TestExpr &t) {
+  auto &w = t.words;
+  if (t.pos >= w.size()) {
+    t.error = "argument expected";
+    return false;
+  }
+  bool binary = t.pos + 2 < w.size() && is_test_binary(w[t.pos + 1]);
+  if (w[t.pos] == "(" && !binary) {
+    t.pos++;
+    bool result = test_or(t);
+    if (t.pos >= w.size() || w[t.pos] != ")") {
+      if (t.error.empty())
+        t.error = "')' expected";
+      return false;
+    }
+    t.pos++;
+    return result;
+  }
+  if (binary) {
+    string_view lhs = w[t.pos], op = w[t.pos + 1], rhs = w[t.pos + 2];
+    t.pos += 3;
+    if (op == "=" || op == "==")
+      return lhs == rhs;
+    if (op == "!=")
+      return lhs != rhs;
+    long long a, b;
+    if (!test_integer(t, lhs, a) || !test_integer(t, rhs, b))
+      return false;
+    if (op == "-eq")
+      return a == b;
+    if (op == "-ne")
+      return a != b;
+    if (op == "-lt")
+      return a < b;
+    if (op == "-le")
+      return a <= b;
+    if (op == "-gt")
+      return a > b;
+    return a >= b;
+  }
+  string_view word = w[t.pos++];
+  if (word.size() == 2 && word[0] == '-' && t.pos < w.size() &&
+      strchr("efdpSbcsrwxLhnz", word[1])) {
+    string_view arg = w[t.pos++];
+    if (word[1] == 'n')
+      return !arg.empty();
+    if (word[1] == 'z')
+      return arg.empty();
+    return test_file(word[1], string(arg).c_str());
+  }
+  return !word.empty();
+}
+
+bool test_not(TestExpr &t) {
+  // "!" alone, or as the left side of a binary operator, is a plain word.
+  if (t.pos + 1 < t.words.size() && t.words[t.pos] == "!" &&
+      !is_test_binary(t.words[t.pos + 1])) {
+    t.pos++;
+    return !test_not(t);
+  }
+  return test_primary(t);
+}
+
+bool test_and(TestExpr &t) {
+  bool result = test_not(t);
+  while (t.pos < t.words.size() && t.words[t.pos] == "-a") {
+    t.pos++;
+    result = test_not(t) && result;
+  }
+  return result;
+}
+
+bool test_or(TestExpr &t) {
+  bool result = test_and(t);
+  while (t.pos < t.words.size() && t.words[t.pos] == "-o") {
+    t.pos++;
+    result = test_and(t) || result;
+  }
+  return result;
+}
+
+int builtin_test(const Command &cmd, Sink &, Sink &err) {
+  string_view name = cmd.args[0];
+  TestExpr t;
+  t.words.assign(cmd.args.begin() + 1, cmd.args.end());
+  if (name == "[") {
+    if (t.words.empty() || t.words.back() != "]") {
+      err << "[: missing ']'\n";
+      return 2;
+    }
+    t.words.pop_back();
+  }
+  if (t.words.empty())
+    return 1;
+  bool result = test_or(t);
+  if (t.error.empty() && t.pos != t.words.size())
+    t.error = string(t.words[t.pos]) + ": unexpected argument";
+  if (!t.error.empty()) {
+    err << name << ": " << t.error << "\n";
+    return 2;
+  }
+  return result ? 0 : 1;
+}
+
+// One backslash escape of printf's format or a %b argument, starting just
+// after the backslash at `s[i]`; advances `i` past it. In %b octal escapes
+// may take a leading 0. Returns false for \c, which stops all output.
+bool printf_escape(string_view s, size_t &i, string &text, bool in_arg) {
+  char ch = s[i++];
+  switch (ch) {
+  case 'a':
+    text += '\a';
+    return true;
+  case 'b':
+    text += '\b';
+    return true;
+  case 'f':
+    text += '\f';
+    return true;
+  case 'n':
+    text += '\n';
+    return true;
+  case 'r':
+    text += '\r';
+    return true;
+  case 't':
+    text += '\t';
+    return true;
+  case 'v':
+    text += '\v';
+    return true;
+  case 'c':
+    return false;
+  }
+  if (ch >= '0' && ch <= '7') {
+    size_t max = in_arg && ch == '0' ? 3 : 2;
+    int value = in_arg && ch == '0' ? 0 : ch - '0';
+    for (size_t n = 0; n < max && i < s.size() && s[i] >= '0' && s[i] <= '7';
+         n++)
+      value = value * 8 + (s[i++] - '0');
+    text += static_cast<char>(value);
+    return true;
+  }
+  if (ch != '\\')
+    text += '\\';
+  text += ch;
+  return true;
+}
+
+// printf FORMAT [ARG...]: C conversions on shell words, with FORMAT reused
+// until the arguments are used up, in the shell itself.
+int builtin_printf(const Command &cmd, Sink &out, Sink &err) {
+  if (cmd.args.size() < 2) {
+    err << "[Usage]: printf format [argument...]\n";
+    return 2;
+  }
+  string_view format = cmd.args[1];
+  size_t next = 2;
+  int status = 0;
+  bool stop = false;
+  string text;
+
+  auto arg = [&]() -> const char * {
+    return next < cmd.args.size() ? cmd.args.argv[next++] : "";
+  };
+  auto parse_number = [&](const char *word, auto strto) {
+    // 'c and "c give the character's code, as in other shells.
+    if (*word == '\'' || *word == '"')
+      return static_cast<decltype(strto(word, nullptr))>(
+          static_cast<unsigned char>(word[1]));
+    char *end;
+    errno = 0;
+    auto value = strto(word, &end);
+    if (*word && (*end || errno)) {
+      err << "printf: " << word << ": invalid number\n";
+      status = 1;
+    }
+    return value;
+  };
+  auto integer = [&](const char *word) {
+    return parse_number(word, [](const char *s, char **end) {
+      return strtoll(s, end, 0);
+    });
+  };
+  auto append = [&](const string &spec, auto value) {
+    int n = snprintf(nullptr, 0, spec.c_str(), value);
+    if (n <= 0)
+      return;
+    size_t at = text.size();
+    text.resize(at + n + 1);
+    snprintf(&text[at], n + 1, spec.c_str(), value);
+    text.resize(at + n);
+  };
+
+  do {
+    size_t used = next;
+    for (size_t i = 0; i < format.size() && !stop; i++) {
+      char ch = format[i];
+      if (ch == '\\' && i + 1 < format.size()) {
+        i++;
+        stop = !printf_escape(format, i, text, false);
+        i--;
+        continue;
+      }
+      if (ch != '%' || i + 1 >= format.size()) {
+        text += ch;
+        continue;
+      }
+      string spec = "%";
+      i++;
+      while (i < format.size() && strchr("-+ #0'", format[i]))
+        spec += format[i++];
+      for (bool precision = false;; precision = true) {
+        if (i < format.size() && format[i] == '*') {
+          spec += to_string(static_cast<int>(integer(arg())));
+          i++;
+        }
+        while (i < format.size() && format[i] >= '0' && format[i] <= '9')
+          spec += format[i++];
+        if (precision || i >= format.size() || format[i] != '.')
+          break;
+        spec += format[i++];
+      }
+      // Length modifiers mean nothing here: integers are always long long
+      // and floats double.
+      while (i < format.size() && strchr("hlLjzt", format[i]))
+        i++;
+      if (i >= format.size()) {
+        err << "printf: " << format << ": missing conversion\n";
+        return 1;
+      }
+      char conv = format[i];
+      switch (conv) {
+      case '%':
+        text += '%';
+        break;
+      case 'd':
+      case 'i':
+        append(spec + "ll" + conv, integer(arg()));
+        break;
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X':
+        append(spec + "ll" + conv,
+               static_cast<unsigned long long>(integer(arg())));
+        break;
+      case 'a':
+      case 'A':
+      case 'e':
+      case 'E':
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G':
+        append(spec + conv, parse_number(arg(), [](const char *s, char **e) {
+                 return strtod(s, e);
+               }));
+        break;
+      case 'c':
+        if (const char *word = arg(); *word)
+          append(spec + 'c', static_cast<int>(*word));
+        break;
+      case 's':
+        append(spec + 's', arg());
+        break;
+      case 'b': {
+        string_view word = arg();
+        string expanded;
+        for (size_t j = 0; j < word.size() && !stop; j++) {
+          if (word[j] == '\\' && j + 1 < word.size()) {
+            j++;
+            stop = !printf_escape(word, j, expanded, true);
+            j--;
+          } else {
+            expanded += word[j];
+          }
+        }
+        append(spec + 's', expanded.c_str());
+        break;
+      }
+      default:
+        err << "printf: %" << conv << ": invalid conversion\n";
+        return 1;
+      }
+    }
+    if (next == used)
+      break;
+  } while (next < cmd.args.size() && !stop);
+  out << text;
+  return status;
+}
+
+using BuiltinFn = int (*)(const Command &, Sink &, Sink &);
+
+struct Builtin {
+  string_view name;
+  BuiltinFn run;
+};
+
+// Sorted by name, which constexpr_sorted() checks at compile time, so
+// lookup is a binary search over a static table: no allocation and no
+// string compares beyond a handful.
+constexpr array<Builtin, 26> builtin_table = {{
+    {"[", builtin_test},
+    {"bg", builtin_bg},
+    {"c", builtin_clear},
+    {"cat", builtin_cat},
+    {"cd", builtin_cd},
+    {"clear", builtin_clear},
+    {"echo", builtin_echo},
+    {"exit", builtin_exit},
+    {"export", builtin_export},
+    {"false", builtin_false},
+    {"fg", builtin_fg},
+    {"hash", builtin_hash},
+    {"jobs", builtin_jobs},
+    {"kill", builtin_kill},
+    {"par", builtin_par},
+    {"parsecache", builtin_parsecache},
+    {"printf", builtin_printf},
+    {"pwd", builtin_pwd},
+    {"set", builtin_set},
+    {"stats", builtin_stats},
+    {"test", builtin_test},
+    {"true", builtin_true},
+    {"type", builtin_type},
+    {"unset", builtin_unset},
+    {"wait", builtin_wait},
+    {"which", builtin_type},
+}};
+
+template <size_t N>
+constexpr bool constexpr_sorted(const array<Builtin, N> &table) {
+  for (size_t i = 1; i < N; i++) {
+    if (!(table[i - 1].name < table[i].name))
+      return false;
+  }
+  return true;
+}
+
+static_assert(constexpr_sorted(builtin_table),
+              "builtin_table must be sorted by name");
+
+const Builtin *find_builtin(string_view name) {
+  auto it = lower_bound(
+      builtin_table.begin(), builtin_table.end(), name,
+      [](const Builtin &b, string_view key) { return b.name < key; });
+  if (it == builtin_table.end() || it->name != name)
+    return nullptr;
+  return &*it;
+}
+
+bool is_builtin(string_view name) { return find_builtin(name) != nullptr; }
+
+// Whether this particular invocation runs as a builtin. The cat builtin
+// only copies files: anything with options goes to the real cat, and so
+// does reading the terminal, which must happen in a foreground child.
+bool runs_as_builtin(const Command &cmd, int stdin_fd = STDIN_FILENO) {
+  string_view name = cmd.args[0];
+  if (name != "cat")
+    return is_builtin(name);
+  bool reads_stdin = cmd.args.size() == 1;
+  for (size_t i = 1; i < cmd.args.size(); i++) {
+    string_view arg = cmd.args[i];
+    if (arg == "-")
+      reads_stdin = true;
+    else if (arg.size() > 1 && arg[0] == '-')
+      return false;
+  }
+  return !reads_stdin || cmd.redirect_stdin || !isatty(stdin_fd);
+}
+
+// How exe_extr() creates children. posix_spawn and vfork share the parent's
+// address space until exec, so they avoid copying page tables; fork is the
+// fallback for children that have to run shell code before exec.
+enum class SpawnBackend { PosixSpawn, Vfork, Fork };
+
+SpawnBackend spawn_backend = SpawnBackend::PosixSpawn;
+
+const char *spawn_backend_name(SpawnBackend backend) {
+  switch (backend) {
+  case SpawnBackend::PosixSpawn:
+    return "posix_spawn";
+  case SpawnBackend::Vfork:
+    return "vfork";
+  case SpawnBackend::Fork:
+    return "fork";
+  }
+  return "?";
+}
+
+bool parse_spawn_backend(const string &name, SpawnBackend &backend) {
+  for (SpawnBackend b :
+       {SpawnBackend::PosixSpawn, SpawnBackend::Vfork, SpawnBackend::Fork}) {
+    if (name == spawn_backend_name(b)) {
+      backend = b;
+      return true;
+    }
+  }
+  return false;
+}
+
+// The fds a child gets as its stdin/stdout/stderr. -1 keeps the shell's own.
+// The parent opens redirect targets, so every backend only has to dup2.
+struct ChildIo {
+  int fd[3] = {-1, -1, -1};
+};
+
+// Where a child goes: its process group (0 starts a new one) and whether
+// that group takes over the terminal.
+struct ChildGroup {
+  pid_t pgid = 0;
+  bool foreground = false;
+};
+
+// The interactive shell's terminal, process group and terminal modes;
+// shell_terminal is -1 when fero is not attached to a terminal and does no
+// job control.
+int shell_terminal = -1;
+pid_t shell_pgid = 0;
+pid_t subshell_pgid = 0; // a subshell's group, which its commands join
+struct termios shell_tmodes;
+
+// Ignored by the interactive shell so it survives handing the terminal to
+// its children; every child gets them back at their defaults.
+const int job_control_signals[] = {SIGTTOU, SIGTTIN, SIGTSTP};
+
+void init_job_control() {
+  if (!isatty(STDIN_FILENO))
+    return;
+  for (int sig : job_control_signals)
+    signal(sig, SIG_IGN);
+  shell_pgid = getpid();
+  if (getpgrp() != shell_pgid)
+    setpgid(0, shell_pgid);
+  shell_terminal = STDIN_FILENO;
+  tcsetpgrp(shell_terminal, shell_pgid);
+  tcgetattr(shell_terminal, &shell_tmodes);
+}
+
+void give_terminal_to(pid_t pgid) {
+  if (shell_terminal != -1)
+    tcsetpgrp(shell_terminal, pgid);
+}
+
+int open_redirect(string_view file, bool append) {
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+  int fd = open(file.data(), flags, 0644);
+  if (fd == -1)
+    perror(("cannot open file: " + string(file)).c_str());
+  return fd;
+}
+
+void close_child_io(ChildIo &io) {
+  for (int &fd : io.fd) {
+    if (fd != -1)
+      close(fd);
+    fd = -1;
+  }
+}
+
+// Here-documents and here-strings up to this size go through a pipe, which
+// holds all of the text before the command starts reading; longer ones go
+// in a memfd. Neither touches the disk.
+const size_t heredoc_pipe_max = 1 << 16;
+
+int text_input_fd(string_view text) {
+  stats.heredoc_bytes += text.size();
+  int p[2];
+  if (text.size() <= heredoc_pipe_max && pipe2(p, O_CLOEXEC) == 0) {
+    int size = fcntl(p[1], F_GETPIPE_SZ);
+    if (size >= 0 && text.size() <= static_cast<size_t>(size) &&
+        write_all(p[1], text.data(), text.size())) {
+      close(p[1]);
+      return p[0];
+    }
+    close(p[0]);
+    close(p[1]);
+  }
+  int fd = memfd_create("fero-heredoc", MFD_CLOEXEC);
+  if (fd == -1 || !write_all(fd, text.data(), text.size()) ||
+      lseek(fd, 0, SEEK_SET) != 0) {
+    perror("here-document");
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// The fd for the stdin redirect of `cmd`, or -1 after reporting why not.
+int open_input(const Command &cmd) {
+  if (cmd.stdin_text)
+    return text_input_fd(cmd.stdin_file);
+  int fd = open(cmd.stdin_file.data(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    perror(("cannot open file: " + string(cmd.stdin_file)).c_str());
+  return fd;
+}
+
+// Applies the redirections of `cmd` over `io`, which holds what the child
+// gets without them (the pipes of its pipeline), so that 2>&1 can copy a
+// pipe as well as a file. On failure `io` is left as it was.
+bool open_child_io(const Command &cmd, ChildIo &io) {
+  int fd[3] = {-1, -1, -1};
+  const OutputRedirect *to[3] = {nullptr, &cmd.stdout_to, &cmd.stderr_to};
+  bool ok = !cmd.redirect_stdin || (fd[STDIN_FILENO] = open_input(cmd)) != -1;
+  for (int t = STDOUT_FILENO; ok && t <= STDERR_FILENO; t++) {
+    if (!to[t]->file.empty())
+      ok = (fd[t] = open_redirect(to[t]->file, to[t]->append)) != -1;
+  }
+  for (int t = STDOUT_FILENO; ok && t <= STDERR_FILENO; t++) {
+    int other = STDOUT_FILENO + STDERR_FILENO - t;
+    int from = to[t]->dup == DupFrom::Target ? fd[other]
+               : io.fd[other] != -1          ? io.fd[other]
+                                             : other;
+    if (to[t]->dup != DupFrom::None &&
+        (fd[t] = fcntl(from, F_DUPFD_CLOEXEC, 0)) == -1) {
+      perror("dup");
+      ok = false;
+    }
+  }
+  for (int t = 0; t < 3; t++) {
+    if (fd[t] == -1)
+      continue;
+    if (!ok) {
+      close(fd[t]);
+    } else {
+      if (io.fd[t] != -1)
+        close(io.fd[t]);
+      io.fd[t] = fd[t];
+    }
+  }
+  return ok;
+}
+
+// Puts the fds of `io` in place of the shell's own stdin, stdout and
+// stderr, for a builtin or group that runs in the shell; pop_fds() puts
+// the originals back.
+void push_fds(ChildIo &io, int (&saved)[3]) {
+  for (int t = 0; t < 3; t++) {
+    saved[t] = -1;
+    if (io.fd[t] == -1)
+      continue;
+    saved[t] = fcntl(t, F_DUPFD_CLOEXEC, 10);
+    dup2(io.fd[t], t);
+  }
+  close_child_io(io);
+}
+
+void pop_fds(const int (&saved)[3]) {
+  for (int t = 0; t < 3; t++) {
+    if (saved[t] != -1) {
+      dup2(saved[t], t);
+      close(saved[t]);
+    }
+  }
+}
+
+// Runs `cmd` if it is a builtin and returns true; its status goes into
+// last_status. Its redirections only decide where its sinks write.
+bool run_builtin(const Command &cmd) {
+  if (cmd.args.empty() || !runs_as_builtin(cmd))
+    return false;
+  const Builtin *builtin = find_builtin(cmd.args[0]);
+
+  cout.flush();
+  // Builtins read stdin from fd 0 itself, so a `<` is put there while it
+  // runs; what it writes goes through the sinks.
+  ChildIo io;
+  int saved[3];
+  if (cmd.redirect_stdin && (io.fd[STDIN_FILENO] = open_input(cmd)) == -1) {
+    last_status = 1;
+    return true;
+  }
+  push_fds(io, saved);
+  Sink out, err;
+  sink_init(out, STDOUT_FILENO, cmd.stdout_to);
+  sink_init(err, STDERR_FILENO, cmd.stderr_to);
+  err.pair = &out;
+  Sink &to_out = cmd.stdout_to.dup == DupFrom::Target ? err : out;
+  Sink &to_err = cmd.stderr_to.dup == DupFrom::Target ? out : err;
+  {
+    PhaseTimer timer(line_timing.builtin);
+    stats.builtins++;
+    last_status = builtin->run(cmd, to_out, to_err);
+  }
+  // A target that couldn't be opened or written fails the command, as it
+  // would an external one.
+  sink_close(out);
+  sink_close(err);
+  if (out.failed || err.failed)
+    last_status = 1;
+  pop_fds(saved);
+  return true;
+}
+
+// Runs between fork/vfork and exec; only async-signal-safe calls here.
+void child_setup(const ChildIo &io, const ChildGroup &group) {
+  setpgid(0, group.pgid);
+  if (group.foreground && shell_terminal != -1)
+    tcsetpgrp(shell_terminal, group.pgid ? group.pgid : getpid());
+  for (int sig : job_control_signals)
+    signal(sig, SIG_DFL);
+  for (int target = 0; target < 3; target++) {
+    if (io.fd[target] != -1)
+      dup2(io.fd[target], target);
+  }
+}
+
+pid_t spawn_posix(const char *path, char *const argv[], char *const envp[],
+                  const ChildIo &io, const ChildGroup &group, int &err) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  for (int target = 0; target < 3; target++) {
+    if (io.fd[target] != -1)
+      posix_spawn_file_actions_adddup2(&actions, io.fd[target], target);
+  }
+
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF;
+  posix_spawnattr_setpgroup(&attr, group.pgid);
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  for (int sig : job_control_signals)
+    sigaddset(&defaults, sig);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+#ifdef POSIX_SPAWN_TCSETPGROUP
+  if (group.foreground && shell_terminal != -1) {
+    flags |= POSIX_SPAWN_TCSETPGROUP;
+    posix_spawnattr_tcsetpgrp_np(&attr, shell_terminal);
+  }
+#endif
+  posix_spawnattr_setflags(&attr, flags);
+
+  pid_t pid = -1;
+  err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  return err == 0 ? pid : -1;
+}
+
+pid_t spawn_vfork(const char *path, char *const argv[], char *const envp[],
+                  const ChildIo &io, const ChildGroup &group, int &err) {
+  // The child borrows our memory until it execs, so it can hand the exec
+  // error straight back through this variable.
+  volatile int child_err = 0;
+  pid_t pid = vfork();
+  if (pid == 0) {
+    child_setup(io, group);
+    execve(path, argv, envp);
+    child_err = errno;
+    _exit(127);
+  }
+  if (pid < 0) {
+    err = errno;
+    return -1;
+  }
+  err = child_err;
+  if (err != 0) {
+    waitpid(pid, nullptr, 0);
+    return -1;
+  }
+  return pid;
+}
+
+pid_t spawn_fork(const char *path, char *const argv[], char *const envp[],
+                 const ChildIo &io, const ChildGroup &group, int &err) {
+  // A close-on-exec pipe reports exec failures back to the parent; a
+  // successful exec closes it with nothing written.
+  int errpipe[2];
+  if (pipe2(errpipe, O_CLOEXEC) != 0) {
+    err = errno;
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(errpipe[0]);
+    child_setup(io, group);
+    execve(path, argv, envp);
+    int e = errno;
+    [[maybe_unused]] ssize_t n = write(errpipe[1], &e, sizeof e);
+    _exit(127);
+  }
+  close(errpipe[1]);
+  if (pid < 0) {
+    err = errno;
+    close(errpipe[0]);
+    return -1;
+  }
+  int child_err = 0;
+  ssize_t n;
+  do {
+    n = read(errpipe[0], &child_err, sizeof child_err);
+  } while (n < 0 && errno == EINTR);
+  close(errpipe[0]);
+  if (n == sizeof child_err) {
+    err = child_err;
+    waitpid(pid, nullptr, 0);
+    return -1;
+  }
+  err = 0;
+  return pid;
+}
+
+pid_t spawn_cmd(const char *path, char *const argv[], char *const envp[],
+                const ChildIo &io, const ChildGroup &group,
+                SpawnBackend backend, int &err) {
+  pid_t pid = -1;
+  switch (backend) {
+  case SpawnBackend::PosixSpawn:
+    pid = spawn_posix(path, argv, envp, io, group, err);
+    break;
+  case SpawnBackend::Vfork:
+    pid = spawn_vfork(path, argv, envp, io, group, err);
+    break;
+  case SpawnBackend::Fork:
+    pid = spawn_fork(path, argv, envp, io, group, err);
+    break;
+  }
+  // Set the group from this side too, so it exists before we wait on it or
+  // start the next stage in it.
+  if (pid > 0)
+    setpgid(pid, group.pgid ? group.pgid : pid);
+  return pid;
+}
+
+void report_spawn_error(const char *name, int err) {
+  if (err == ENOENT)
+    cerr << RED << "fero: command not found: " << name << RESET << endl;
+  else
+    cerr << RED << "fero: " << name << ": " << strerror(err) << RESET << endl;
+}
+
+void enter_subshell();
+int run_node(const Ast &ast, uint32_t idx);
+
+// The Ast being run, which the bodies of ( ) and { } stages are nodes of.
+const Ast *running_ast = nullptr;
+
+// Builtins inside a pipeline, subshells and groups need shell code in the
+// child, so they always take the fork path and exit with the status of
+// what they ran.
+pid_t spawn_shell(const Command &cmd, const ChildIo &io,
+                  const ChildGroup &group, int close_fd) {
+  cout.flush();
+  pid_t pid = fork();
+  if (pid == 0) {
+    child_setup(io, group);
+    for (int fd : io.fd) {
+      if (fd > STDERR_FILENO)
+        close(fd);
+    }
+    if (close_fd != -1)
+      close(close_fd);
+    enter_subshell();
+    if (cmd.kind == CommandKind::Simple) {
+      // io already holds the redirections.
+      Command plain = cmd;
+      plain.redirect_stdin = false;
+      plain.stdout_to = plain.stderr_to = OutputRedirect();
+      run_builtin(plain);
+    } else
+      run_node(*running_ast, cmd.body);
+    cout.flush();
+    _exit(last_status);
+  }
+  if (pid < 0) {
+    perror("fork");
+    stats.spawn_failures++;
+    return -1;
+  }
+  stats.subshells++;
+  setpgid(pid, group.pgid ? group.pgid : pid);
+  return pid;
+}
+
+// Starts one stage and returns its pid, or -1 when it could not be started
+// (the error has been reported). `close_fd` is a shell-side fd the child
+// must not keep open.
+pid_t launch_stage(const Command &cmd, ChildIo &io, const ChildGroup &group,
+                   int close_fd) {
+  if (cmd.kind != CommandKind::Simple)
+    return spawn_shell(cmd, io, group, close_fd);
+  const char *name = cmd.args.argv[0];
+  int stdin_fd = io.fd[STDIN_FILENO] != -1 ? io.fd[STDIN_FILENO] : STDIN_FILENO;
+  if (runs_as_builtin(cmd, stdin_fd))
+    return spawn_shell(cmd, io, group, close_fd);
+
+  const char *path = resolve_command(name);
+  if (!path) {
+    report_spawn_error(name, ENOENT);
+    stats.spawn_failures++;
+    return -1;
+  }
+
+  vector<char *> own_env;
+  char *const *envp = shell_envp.data();
+  if (cmd.env) {
+    own_env = command_envp(cmd.env);
+    envp = own_env.data();
+  }
+  int err = 0;
+  pid_t pid =
+      spawn_cmd(path, cmd.args.argv, envp, io, group, spawn_backend, err);
+  if (pid < 0 && err == ENOENT && command_hash.erase(name)) {
+    // The hashed binary went away; look it up again before giving up.
+    path = resolve_command(name);
+    if (path)
+      pid = spawn_cmd(path, cmd.args.argv, envp, io, group, spawn_backend,
+                      err);
+  }
+  if (pid < 0) {
+    report_spawn_error(name, err);
+    stats.spawn_failures++;
+  } else {
+    stats.externals++;
+  }
+  return pid;
+}
+
+int exit_code(int status) {
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  if (WIFSTOPPED(status))
+    return 128 + WSTOPSIG(status);
+  return 1;
+}
+
+// SIGCHLD only writes a byte here; the shell reaps with waitpid(WNOHANG)
+// whenever the read end is readable, so nothing has to poll.
+int sigchld_pipe[2] = {-1, -1};
+
+void on_sigchld(int) {
+  int saved = errno;
+  char byte = 0;
+  [[maybe_unused]] ssize_t n = write(sigchld_pipe[1], &byte, 1);
+  errno = saved;
+}
+
+void init_sigchld() {
+  if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+    perror("pipe");
+    return;
+  }
+  struct sigaction sa = {};
+  sa.sa_handler = on_sigchld;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGCHLD, &sa, nullptr);
+}
+
+Job *find_job(int id) {
+  for (auto &job : jobs) {
+    if (job.id == id)
+      return &job;
+  }
+  return nullptr;
+}
+
+bool job_done(const Job &job) {
+  return all_of(job.procs.begin(), job.procs.end(),
+                [](const JobProc &p) { return p.done; });
+}
+
+bool job_stopped(const Job &job) {
+  bool any = false;
+  for (const auto &p : job.procs) {
+    if (!p.done && !p.stopped)
+      return false;
+    any = any || p.stopped;
+  }
+  return any;
+}
+
+// The last stage's status, or with pipefail the last non-zero one.
+int job_status(const Job &job) {
+  int result = job.procs.back().code;
+  if (opt_pipefail) {
+    for (size_t i = job.procs.size(); i-- > 0;) {
+      if (job.procs[i].code != 0) {
+        result = job.procs[i].code;
+        break;
+      }
+    }
+  }
+  return result;
+}
+
+void update_job_proc(pid_t pid, int status, const struct rusage &usage) {
+  for (auto &job : jobs) {
+    for (auto &p : job.procs) {
+      if (p.pid != pid)
+        continue;
+      if (WIFSTOPPED(status)) {
+        p.stopped = true;
+      } else if (WIFCONTINUED(status)) {
+        p.stopped = false;
+      } else {
+        p.done = true;
+        p.stopped = false;
+        add_usage(job.usage, usage);
+      }
+      p.code = exit_code(status);
+      return;
+    }
+  }
+}
+
+void reap_children() {
+  char buf[64];
+  while (sigchld_pipe[0] != -1 && read(sigchld_pipe[0], buf, sizeof buf) > 0)
+    ;
+  int status;
+  struct rusage usage;
+  pid_t pid;
+  while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED,
+                      &usage)) > 0)
+    update_job_proc(pid, status, usage);
+}
+
+// Blocks until the SIGCHLD pipe is readable, then reaps.
+void wait_for_sigchld() {
+  if (sigchld_pipe[0] == -1) {
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+    if (pid > 0)
+      update_job_proc(pid, status, usage);
+    return;
+  }
+  struct pollfd pfd = {sigchld_pipe[0], POLLIN, 0};
+  if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+    return;
+  reap_children();
+}
+
+void erase_job(int id) {
+  jobs.erase(remove_if(jobs.begin(), jobs.end(),
+                       [&](const Job &job) { return job.id == id; }),
+             jobs.end());
+  if (current_job == id)
+    current_job = jobs.empty() ? 0 : jobs.back().id;
+}
+
+const char *job_state(const Job &job) {
+  if (job_done(job))
+    return "Done";
+  return job_stopped(job) ? "Stopped" : "Running";
+}
+
+string job_line(const Job &job) {
+  char line[64];
+  snprintf(line, sizeof line, "[%d]%c  %-24s", job.id,
+           job.id == current_job ? '+' : ' ', job_state(job));
+  return line + job.text +
+         (job_done(job) || job_stopped(job) ? "" : " &") + "\n";
+}
+
+void print_job(const Job &job) { cout << job_line(job); }
+
+// Reports background jobs that finished or stopped since the last prompt
+// and drops the finished ones.
+void notify_jobs() {
+  reap_children();
+  vector<int> finished;
+  for (auto &job : jobs) {
+    if (job_done(job)) {
+      print_job(job);
+      finished.push_back(job.id);
+    } else if (job_stopped(job) && !job.notified) {
+      print_job(job);
+      job.notified = true;
+    }
+  }
+  for (int id : finished)
+    erase_job(id);
+}
+
+// Gives the job the terminal and blocks until it exits or stops. A job
+// that finishes leaves the table; a stopped one stays for fg/bg. Without
+// job control, as in a subshell, there is no fg to come back with, so a
+// stopped job is waited for until it is continued and exits.
+int wait_foreground(Job &job) {
+  int id = job.id;
+  pid_t pgid = job.pgid;
+  if (job.has_tmodes && shell_terminal != -1)
+    tcsetattr(shell_terminal, TCSADRAIN, &job.tmodes);
+  while (true) {
+    Job *j = find_job(id);
+    if (!j || job_done(*j) || (job_stopped(*j) && shell_terminal != -1))
+      break;
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(-pgid, &status, WUNTRACED, &usage);
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    update_job_proc(pid, status, usage);
+  }
+  give_terminal_to(shell_pgid);
+
+  Job *j = find_job(id);
+  if (!j)
+    return 0;
+  int result = job_status(*j);
+  if (job_stopped(*j)) {
+    if (shell_terminal != -1) {
+      j->has_tmodes = tcgetattr(shell_terminal, &j->tmodes) == 0;
+      tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+    }
+    j->foreground = false;
+    j->notified = true;
+    current_job = id;
+    cout << "\n";
+    print_job(*j);
+  } else {
+    if (shell_terminal != -1)
+      tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+    add_usage(fg_usage, j->usage);
+    erase_job(id);
+  }
+  return result;
+}
+
+// Starts every stage up front, each reading the previous one's pipe, as one
+// job in its own process group. A foreground job is waited for; a
+// background one is left running in the job table.
+int run_stages(const Command *stages, size_t n, string_view text = "",
+               bool background = false) {
+  Job job;
+  job.id = jobs.empty() ? 1 : jobs.back().id + 1;
+  job.text = text;
+  job.foreground = !background;
+  job.procs.resize(n);
+  ChildGroup group;
+  // A background job gets a group of its own even without job control, so
+  // that kill %N can't reach the shell.
+  group.pgid = background ? 0 : subshell_pgid;
+  group.foreground = !background;
+  int prev_read = -1;
+  bool started = false;
+
+  for (size_t i = 0; i < n; i++) {
+    JobProc &proc = job.procs[i];
+    proc.done = true;
+    int pipefd[2] = {-1, -1};
+    if (i + 1 < n && pipe2(pipefd, O_CLOEXEC) != 0) {
+      perror("pipe");
+      break;
+    }
+
+    ChildIo io;
+    if (prev_read != -1)
+      io.fd[STDIN_FILENO] = fcntl(prev_read, F_DUPFD_CLOEXEC, 0);
+    if (pipefd[1] != -1)
+      io.fd[STDOUT_FILENO] = fcntl(pipefd[1], F_DUPFD_CLOEXEC, 0);
+    if (open_child_io(stages[i], io)) {
+      if (stages[i].kind == CommandKind::Simple && stages[i].args.empty()) {
+        // Only NAME=value, which in a pipeline sets nothing.
+        proc.code = 0;
+      } else {
+        PhaseTimer timer(line_timing.spawn);
+        proc.pid = launch_stage(stages[i], io, group, pipefd[0]);
+      }
+      proc.done = proc.pid < 0;
+    } else {
+      proc.code = 1;
+    }
+    close_child_io(io);
+
+    if (proc.pid > 0 && group.pgid == 0) {
+      group.pgid = proc.pid;
+      if (!background)
+        give_terminal_to(group.pgid);
+    }
+    started |= proc.pid > 0;
+    if (prev_read != -1)
+      close(prev_read);
+    if (pipefd[1] != -1)
+      close(pipefd[1]);
+    prev_read = pipefd[0];
+  }
+  if (prev_read != -1)
+    close(prev_read);
+
+  if (!started)
+    return job_status(job);
+  job.pgid = group.pgid;
+  jobs.push_back(move(job));
+  Job &added = jobs.back();
+  if (background) {
+    current_job = added.id;
+    if (shell_terminal != -1)
+      cout << "[" << added.id << "] " << added.pgid << "\n";
+    return 0;
+  }
+  PhaseTimer timer(line_timing.wait);
+  return wait_foreground(added);
+}
+
+int exe_extr(const Command &cmd) { return run_stages(&cmd, 1); }
+
+// Turns a forked child into a non-interactive shell: no terminal, none of
+// its parent's jobs, and a SIGCHLD pipe of its own. What it runs stays in
+// its process group, so Ctrl-C and Ctrl-Z reach all of it.
+void enter_subshell() {
+  stats_file.clear();
+  jobs.clear();
+  current_job = 0;
+  shell_terminal = -1;
+  subshell_pgid = getpgrp();
+  // The worker threads didn't survive the fork, and whatever their locks
+  // guard is left alone. The index the watcher left is revalidated by stat
+  // from here on, as in a script.
+  path_watcher = nullptr;
+  prompt_worker = nullptr;
+  completion_worker = nullptr;
+  if (sigchld_pipe[0] != -1) {
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    init_sigchld();
+  }
+}
+
+// `{ list; }` with redirections: they apply to the shell itself while the
+// list runs, as for a builtin.
+void run_group(const Ast &ast, const Command &cmd) {
+  ChildIo io;
+  int saved[3];
+  cout.flush();
+  if (!open_child_io(cmd, io)) {
+    last_status = 1;
+    return;
+  }
+  push_fds(io, saved);
+  run_node(ast, cmd.body);
+  cout.flush();
+  pop_fds(saved);
+}
+
+// What `time` started from: the clock, and the shell's own usage, which
+// covers builtins and groups run in the shell.
+struct TimeSample {
+  chrono::steady_clock::time_point wall;
+  struct rusage self;
+};
+
+void time_start(TimeSample &sample) {
+  fg_usage = {};
+  getrusage(RUSAGE_SELF, &sample.self);
+  sample.wall = chrono::steady_clock::now();
+}
+
+string format_seconds(double secs) {
+  char buf[32];
+  int mins = static_cast<int>(secs / 60);
+  snprintf(buf, sizeof buf, "%dm%.3fs", mins, secs - mins * 60);
+  return buf;
+}
+
+double seconds(const struct timeval &tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Reports, on the shell's stderr, the wall clock and the usage of the
+// timed pipeline: its processes as reported by wait4(), plus what the
+// shell itself used meanwhile. Max RSS is that of the largest process.
+void time_report(const TimeSample &sample) {
+  chrono::duration<double> wall = chrono::steady_clock::now() - sample.wall;
+  struct rusage self;
+  getrusage(RUSAGE_SELF, &self);
+  struct rusage total = fg_usage;
+  struct timeval t;
+  timersub(&self.ru_utime, &sample.self.ru_utime, &t);
+  timeradd(&total.ru_utime, &t, &total.ru_utime);
+  timersub(&self.ru_stime, &sample.self.ru_stime, &t);
+  timeradd(&total.ru_stime, &t, &total.ru_stime);
+  total.ru_nvcsw += self.ru_nvcsw - sample.self.ru_nvcsw;
+  total.ru_nivcsw += self.ru_nivcsw - sample.self.ru_nivcsw;
+  if (total.ru_maxrss == 0)
+    total.ru_maxrss = self.ru_maxrss;
+
+  cout.flush();
+  cerr << "\nreal\t" << format_seconds(wall.count()) << "\n"
+       << "user\t" << format_seconds(seconds(total.ru_utime)) << "\n"
+       << "sys\t" << format_seconds(seconds(total.ru_stime)) << "\n"
+       << "maxrss\t" << total.ru_maxrss << " KiB\n"
+       << "csw\t" << total.ru_nvcsw << " voluntary, " << total.ru_nivcsw
+       << " involuntary\n";
+}
+
+// A command of nothing but NAME=value words and redirects sets shell
+// variables.
+int run_assignments(const Command &cmd) {
+  // Any redirect targets are opened, and closed again unused.
+  ChildIo io;
+  bool opened = open_child_io(cmd, io);
+  close_child_io(io);
+  if (!opened)
+    return 1;
+  for (char **a = cmd.env; a && *a; a++) {
+    const char *eq = strchr(*a, '=');
+    set_var(string(*a, eq - *a), eq + 1);
+  }
+  return 0;
+}
+
+// Runs node `idx` of `ast` and returns its status, also left in
+// last_status.
+int run_node(const Ast &ast, uint32_t idx) {
+  const Node &node = ast.nodes[idx];
+  switch (node.kind) {
+  case NodeKind::Pipeline: {
+    Arena arena;
+    vector<Command> expanded;
+    const Command *stages =
+        expand_stages(&ast.cmds[node.a], node.b, arena, expanded);
+    if (!stages) {
+      last_status = 1;
+      break;
+    }
+    TimeSample sample;
+    if (node.timed)
+      time_start(sample);
+    if (node.b == 1 && stages[0].kind == CommandKind::Group)
+      run_group(ast, stages[0]);
+    else if (node.b == 1 && stages[0].kind == CommandKind::Simple &&
+             stages[0].args.empty())
+      last_status = run_assignments(stages[0]);
+    else if (node.b != 1 || !run_builtin(stages[0]))
+      last_status = run_stages(stages, node.b, node.text);
+    if (node.timed)
+      time_report(sample);
+    break;
+  }
+  case NodeKind::And:
+    if (run_node(ast, node.a) == 0)
+      run_node(ast, node.b);
+    break;
+  case NodeKind::Or:
+    if (run_node(ast, node.a) != 0)
+      run_node(ast, node.b);
+    break;
+  case NodeKind::Seq:
+    run_node(ast, node.a);
+    run_node(ast, node.b);
+    break;
+  case NodeKind::Async: {
+    // A pipeline becomes a background job of its own; anything bigger
+    // runs in a background subshell.
+    const Node &job = ast.nodes[node.a];
+    if (job.kind == NodeKind::Pipeline) {
+      Arena arena;
+      vector<Command> expanded;
+      const Command *stages =
+          expand_stages(&ast.cmds[job.a], job.b, arena, expanded);
+      last_status = stages ? run_stages(stages, job.b, job.text, true) : 1;
+    } else {
+      Command sub;
+      sub.kind = CommandKind::Subshell;
+      sub.body = node.a;
+      last_status = run_stages(&sub, 1, job.text, true);
+    }
+    break;
+  }
+  }
+  return last_status;
+}
+
+int run_ast(const Ast &ast) {
+  if (ast.nodes.empty())
+    return last_status;
+  const Ast *outer = running_ast;
+  running_ast = &ast;
+  run_node(ast, ast.root);
+  running_ast = outer;
+  return last_status;
+}
+
+// `text` as a decimal number, if that is all it is.
+bool parse_long(string_view text, long &value) {
+  string digits(text);
+  char *end;
+  errno = 0;
+  value = strtol(digits.c_str(), &end, 10);
+  return !digits.empty() && *end == '\0' && errno == 0;
+}
+
+// The job a %N or N spec names; %, %% and %+ are the current job.
+Job *find_job_spec(string_view spec) {
+  if (!spec.empty() && spec[0] == '%')
+    spec.remove_prefix(1);
+  if (spec.empty() || spec == "%" || spec == "+")
+    return find_job(current_job);
+  long id;
+  return parse_long(spec, id) ? find_job(id) : nullptr;
+}
+
+// Parses a %N, N or empty job spec; empty means the current job.
+Job *job_from_spec(const Command &cmd, const string &name, Sink &err) {
+  Job *job = cmd.args.size() >= 2 ? find_job_spec(cmd.args[1])
+                                  : find_job(current_job);
+  if (!job) {
+    if (cmd.args.size() >= 2)
+      err << name << ": " << cmd.args[1] << ": no such job\n";
+    else
+      err << name << ": no current job\n";
+  }
+  return job;
+}
+
+int builtin_fg(const Command &cmd, Sink &out, Sink &err) {
+  Job *job = job_from_spec(cmd, "fg", err);
+  if (!job)
+    return 1;
+  out << job->text << "\n";
+  sink_flush(out);
+  job->foreground = true;
+  job->notified = false;
+  for (auto &p : job->procs)
+    p.stopped = false;
+  give_terminal_to(job->pgid);
+  kill(-job->pgid, SIGCONT);
+  return wait_foreground(*job);
+}
+
+// kill <pid | %job> [signal]: a job's whole process group is signalled,
+// and continued if it was stopped, so it can act on the signal.
+int builtin_kill(const Command &cmd, Sink &out, Sink &err) {
+  if (cmd.args.size() < 2) {
+    out << "[Usage]: kill <pid | %job> [signal]\n";
+    return 0;
+  }
+  string_view target = cmd.args[1];
+  long sig = SIGTERM;
+  if (cmd.args.size() >= 3 &&
+      (!parse_long(cmd.args[2], sig) || sig < 0 || sig >= NSIG)) {
+    err << "kill: " << cmd.args[2] << ": invalid signal\n";
+    return 1;
+  }
+  pid_t pid;
+  Job *job = nullptr;
+  long number;
+  if (!target.empty() && target[0] == '%') {
+    if (!(job = find_job_spec(target))) {
+      err << "kill: " << target << ": no such job\n";
+      return 1;
+    }
+    pid = -job->pgid;
+  } else if (parse_long(target, number) && number > 0 && number <= INT_MAX) {
+    pid = number;
+  } else {
+    err << "kill: " << target << ": invalid pid\n";
+    return 1;
+  }
+  if (kill(pid, sig) != 0) {
+    err << "kill: " << target << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+  if (job && job_stopped(*job) && sig != SIGCONT)
+    kill(pid, SIGCONT);
+  return 0;
+}
+
+int builtin_bg(const Command &cmd, Sink &out, Sink &err) {
+  Job *job = job_from_spec(cmd, "bg", err);
+  if (!job)
+    return 1;
+  job->foreground = false;
+  job->notified = false;
+  for (auto &p : job->procs)
+    p.stopped = false;
+  current_job = job->id;
+  out << "[" << job->id << "]+ " << job->text << " &\n";
+  kill(-job->pgid, SIGCONT);
+  return 0;
+}
+
+int builtin_jobs(const Command &, Sink &out, Sink &) {
+  reap_children();
+  vector<int> finished;
+  for (auto &job : jobs) {
+    out << job_line(job);
+    if (job_done(job))
+      finished.push_back(job.id);
+    else if (job_stopped(job))
+      job.notified = true;
+  }
+  for (int id : finished)
+    erase_job(id);
+  return 0;
+}
+
+// `wait` with no arguments waits for every background job; otherwise for
+// the given %jobs or pids. Sleeps on the SIGCHLD pipe between reaps.
+int builtin_wait(const Command &cmd, Sink &, Sink &err) {
+  vector<int> ids;
+  for (size_t i = 1; i < cmd.args.size(); i++) {
+    string arg(cmd.args[i]);
+    int id = -1;
+    try {
+      if (!arg.empty() && arg[0] == '%') {
+        id = stoi(arg.substr(1));
+      } else {
+        pid_t pid = stoi(arg);
+        for (const auto &job : jobs) {
+          for (const auto &p : job.procs) {
+            if (p.pid == pid)
+              id = job.id;
+          }
+        }
+      }
+    } catch (const exception &) {
+    }
+    if (!find_job(id)) {
+      err << "wait: " << arg << ": no such job\n";
+      continue;
+    }
+    ids.push_back(id);
+  }
+  if (cmd.args.size() < 2) {
+    for (const auto &job : jobs)
+      ids.push_back(job.id);
+  }
+
+  int result = 0;
+  for (int id : ids) {
+    while (true) {
+      reap_children();
+      Job *job = find_job(id);
+      if (!job || job_done(*job) || job_stopped(*job))
+        break;
+      wait_for_sigchld();
+    }
+    if (Job *job = find_job(id)) {
+      result = job_status(*job);
+      if (job_done(*job))
+        erase_job(id);
+    }
+  }
+  return result;
+}
+
+// One command started by par, and everything it printed so far. Output is
+// held back until the command exits so lines of different jobs never
+// interleave.
+struct ParJob {
+  string arg;
+  pid_t pid = -1;
+  int fds[2] = {-1, -1}; // read ends of its stdout and stderr pipes
+  string out[2];
+  int code = 0;
+  bool reaped = false;
+  bool emitted = false;
+};
+
+bool par_finished(const ParJob &job) {
+  return job.reaped && job.fds[0] == -1 && job.fds[1] == -1;
+}
+
+// Writes a finished job's output, each line prefixed with its argument when
+// `tag` is set, and flushes it so it isn't held behind slower jobs.
+void par_emit(const ParJob &job, bool tag, Sink &out, Sink &err) {
+  for (int stream = 0; stream < 2; stream++) {
+    const string &text = job.out[stream];
+    Sink &sink = stream == 0 ? out : err;
+    size_t pos = 0;
+    while (tag && pos < text.size()) {
+      size_t nl = text.find('\n', pos);
+      size_t end = nl == string::npos ? text.size() : nl + 1;
+      sink << job.arg << '\t'
+           << string_view(text).substr(pos, end - pos);
+      if (nl == string::npos)
+        sink << '\n';
+      pos = end;
+    }
+    if (!tag)
+      sink << text;
+    sink_flush(sink);
+  }
+}
+
+// par [-j N] [--tag] command [args...] ::: arg...
+//
+// Runs the command once per argument after `:::`, with "{}" in the
+// template replaced by it (or the argument appended when there is no
+// "{}"), at most N at a time: by default one per online CPU. All jobs
+// share one foreground process group; pipe output and SIGCHLD are
+// collected by a single epoll loop. Returns the number of failed jobs,
+// capped at 101. A job killed by SIGINT stops the remaining ones from
+// being started.
+int builtin_par(const Command &cmd, Sink &out, Sink &err) {
+  long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  bool tag = false;
+  size_t i = 1;
+  for (; i < cmd.args.size(); i++) {
+    string_view arg = cmd.args[i];
+    if (arg == "-j" && i + 1 < cmd.args.size()) {
+      try {
+        max_jobs = stol(string(cmd.args[++i]));
+      } catch (const exception &) {
+        max_jobs = 0;
+      }
+    } else if (arg == "--tag") {
+      tag = true;
+    } else {
+      break;
+    }
+  }
+  auto sep = find(cmd.args.begin() + i, cmd.args.end(), ":::");
+  if (max_jobs < 1 || sep == cmd.args.begin() + i || sep == cmd.args.end()) {
+    err << "[Usage]: par [-j N] [--tag] <Command> [args...] ::: <arg>...\n";
+    return 2;
+  }
+  vector<string> tmpl(cmd.args.begin() + i, sep);
+  vector<ParJob> all;
+  for (auto it = sep + 1; it != cmd.args.end(); ++it) {
+    ParJob job;
+    job.arg = *it;
+    all.push_back(move(job));
+  }
+  if (sigchld_pipe[0] == -1)
+    init_sigchld();
+
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  if (ep == -1) {
+    err << "epoll_create1: " << strerror(errno) << "\n";
+    return 1;
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u64 = UINT64_MAX;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sigchld_pipe[0], &ev);
+
+  size_t next = 0, running = 0, failed = 0;
+  ChildGroup group;
+  group.foreground = true;
+
+  // Each job's argv only has to live until it is started.
+  Arena arena;
+  auto start = [&](size_t idx) {
+    ParJob &job = all[idx];
+    vector<string> words;
+    bool substituted = false;
+    for (const auto &word : tmpl) {
+      size_t pos = word.find("{}");
+      if (pos == string::npos) {
+        words.push_back(word);
+        continue;
+      }
+      string arg = word;
+      for (; pos != string::npos; pos = arg.find("{}", pos + job.arg.size()))
+        arg.replace(pos, 2, job.arg);
+      words.push_back(arg);
+      substituted = true;
+    }
+    if (!substituted)
+      words.push_back(job.arg);
+    Command job_cmd;
+    arena_reset(arena);
+    set_args(job_cmd, arena, words);
+
+    int out_pipe[2], err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+      err << "pipe: " << strerror(errno) << "\n";
+      job.code = 1;
+      job.reaped = true;
+      return;
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) != 0) {
+      err << "pipe: " << strerror(errno) << "\n";
+      close(out_pipe[0]);
+      close(out_pipe[1]);
+      job.code = 1;
+      job.reaped = true;
+      return;
+    }
+    ChildIo io;
+    io.fd[STDOUT_FILENO] = out_pipe[1];
+    io.fd[STDERR_FILENO] = err_pipe[1];
+    // An empty group can't be joined, so start a new one when nothing of
+    // the old one is left. Without job control the jobs stay in ours.
+    if (running == 0)
+      group.pgid = subshell_pgid;
+    job.pid = launch_stage(job_cmd, io, group, -1);
+    close_child_io(io);
+    if (job.pid < 0) {
+      close(out_pipe[0]);
+      close(err_pipe[0]);
+      job.code = 127;
+      job.reaped = true;
+      return;
+    }
+    if (group.pgid == 0) {
+      group.pgid = job.pid;
+      give_terminal_to(group.pgid);
+    }
+    job.fds[0] = out_pipe[0];
+    job.fds[1] = err_pipe[0];
+    for (int stream = 0; stream < 2; stream++) {
+      fcntl(job.fds[stream], F_SETFL, O_NONBLOCK);
+      struct epoll_event jev = {};
+      jev.events = EPOLLIN;
+      jev.data.u64 = idx << 1 | stream;
+      epoll_ctl(ep, EPOLL_CTL_ADD, job.fds[stream], &jev);
+    }
+    running++;
+  };
+
+  auto finish = [&](ParJob &job) {
+    par_emit(job, tag, out, err);
+    if (job.code != 0)
+      failed++;
+    job.out[0].clear();
+    job.out[1].clear();
+    job.emitted = true;
+  };
+
+  while (next < all.size() || running > 0) {
+    while (running < static_cast<size_t>(max_jobs) && next < all.size()) {
+      size_t idx = next++;
+      start(idx);
+      if (all[idx].pid < 0)
+        finish(all[idx]);
+    }
+    if (running == 0)
+      continue;
+
+    struct epoll_event events[64];
+    int n = epoll_wait(ep, events, 64, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      err << "epoll_wait: " << strerror(errno) << "\n";
+      break;
+    }
+    for (int e = 0; e < n; e++) {
+      uint64_t key = events[e].data.u64;
+      if (key == UINT64_MAX)
+        continue;
+      ParJob &job = all[key >> 1];
+      int stream = key & 1;
+      char buf[1 << 16];
+      ssize_t got;
+      while ((got = read(job.fds[stream], buf, sizeof buf)) > 0)
+        job.out[stream].append(buf, got);
+      if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, job.fds[stream], nullptr);
+        close(job.fds[stream]);
+        job.fds[stream] = -1;
+      }
+    }
+
+    // Reap whatever exited. Children that are not ours belong to the job
+    // table.
+    char drain[64];
+    while (read(sigchld_pipe[0], drain, sizeof drain) > 0)
+      ;
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED,
+                        &usage)) > 0) {
+      auto it = find_if(all.begin(), all.end(),
+                        [&](const ParJob &j) { return j.pid == pid; });
+      if (it == all.end()) {
+        update_job_proc(pid, status, usage);
+        continue;
+      }
+      if (WIFSTOPPED(status) || WIFCONTINUED(status))
+        continue;
+      add_usage(fg_usage, usage);
+      it->code = exit_code(status);
+      it->reaped = true;
+      // Ctrl-C reaches the running jobs; don't start the rest.
+      if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+        next = all.size();
+    }
+
+    for (auto &job : all) {
+      if (job.pid > 0 && !job.emitted && par_finished(job)) {
+        finish(job);
+        running--;
+      }
+    }
+  }
+  close(ep);
+  give_terminal_to(shell_pgid);
+  return failed > 101 ? 101 : static_cast<int>(failed);
+}
+
+string format_duration(chrono::nanoseconds d) {
+  char buf[32];
+  double us = d.count() / 1e3;
+  if (us < 1000)
+    snprintf(buf, sizeof buf, "%.1fus", us);
+  else if (us < 1e6)
+    snprintf(buf, sizeof buf, "%.2fms", us / 1e3);
+  else
+    snprintf(buf, sizeof buf, "%.3fs", us / 1e6);
+  return buf;
+}
+
+// With `set -o timing`, what the shell spent on one line.
+void report_line_timing() {
+  const LineTiming &t = line_timing;
+  cout.flush();
+  cerr << "fero: parse " << format_duration(t.parse)
+       << (t.cached ? " (cached)" : "") << ", builtin "
+       << format_duration(t.builtin) << ", spawn " << format_duration(t.spawn)
+       << ", wait " << format_duration(t.wait) << "\n";
+}
+
+// Parses and runs one command line.
+void run_line(string_view input) {
+  line_timing = {};
+  const Ast *ast;
+  {
+    PhaseTimer timer(line_timing.parse);
+    size_t hits = parse_cache.hits;
+    ast = parse_cached(input);
+    line_timing.cached = parse_cache.hits != hits;
+  }
+  if (!ast) {
+    last_status = 2;
+    return;
+  }
+  // Timing stays on for the line that turns it off.
+  bool timing = opt_timing;
+  run_ast(*ast);
+  if (timing && !ast->nodes.empty())
+    report_line_timing();
+}
+
+// Command lines from a script or a non-terminal stdin. A regular file is
+// mmap'd and split in place; anything else is read in large chunks.
+struct LineSource {
+  int fd = -1;
+  const char *map = nullptr;
+  size_t size = 0, pos = 0;
+
+  string buf;
+  size_t start = 0;
+  bool eof = false;
+};
+
+void open_line_source(LineSource &src, int fd) {
+  src.fd = fd;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      src.map = static_cast<const char *>(map);
+      src.size = st.st_size;
+    }
+  }
+}
+
+// The next line without its newline; false at the end of input.
+bool next_line(LineSource &src, string_view &line) {
+  if (src.map) {
+    if (src.pos >= src.size)
+      return false;
+    const char *begin = src.map + src.pos;
+    const char *nl =
+        static_cast<const char *>(memchr(begin, '\n', src.size - src.pos));
+    size_t len = nl ? nl - begin : src.size - src.pos;
+    line = string_view(begin, len);
+    src.pos += len + 1;
+    return true;
+  }
+
+  while (true) {
+    size_t nl = src.buf.find('\n', src.start);
+    if (nl != string::npos) {
+      line = string_view(src.buf).substr(src.start, nl - src.start);
+      src.start = nl + 1;
+      return true;
+    }
+    if (src.eof) {
+      if (src.start >= src.buf.size())
+        return false;
+      line = string_view(src.buf).substr(src.start);
+      src.start = src.buf.size();
+      return true;
+    }
+    src.buf.erase(0, src.start);
+    src.start = 0;
+    size_t old = src.buf.size();
+    src.buf.resize(old + (1 << 16));
+    ssize_t n = read(src.fd, &src.buf[old], 1 << 16);
+    while (n < 0 && errno == EINTR)
+      n = read(src.fd, &src.buf[old], 1 << 16);
+    src.buf.resize(old + max<ssize_t>(n, 0));
+    if (n <= 0)
+      src.eof = true;
+  }
+}
+
+// Runs every line from `src`, with the here-document bodies after a line
+// joined to it; returns the last status.
+int run_lines(LineSource &src) {
+  string_view line;
+  string text; // a line and the here-document bodies after it
+  while (next_line(src, line)) {
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first == string_view::npos || line[first] == '#')
+      continue;
+    if (heredoc_open(line)) {
+      text.assign(line);
+      while (heredoc_open(text) && next_line(src, line)) {
+        text += '\n';
+        text += line;
+      }
+      line = text;
+    }
+    run_line(line);
+    reap_children();
+  }
+  return last_status;
+}
+
+// Runs a script, or whatever is piped in: no terminal setup, no prompt and
+// no history, just lines as fast as they can be parsed and run.
+int run_script(int fd) {
+  LineSource src;
+  open_line_source(src, fd);
+  return run_lines(src);
+}
+
+// Server mode, for callers that would otherwise start a fero per command:
+//
+//   fero --server SOCKET [-j N]
+//   fero --client SOCKET [command...]   # or the request on stdin
+//
+// The server listens on a Unix socket and forks a child for each request,
+// at most N at a time (by default one per online CPU), so every request
+// starts from the server's warm PATH index, parse cache and environment.
+// Being a child, a request's `cd` or `export` doesn't reach the next one.
+// A connection carries any number of requests, one after another, and
+// both directions are sent as frames: a type byte, a u32 length in host
+// order, and that many bytes.
+//
+//   client: 'r' the request, run like a script with stdin at /dev/null
+//   server: 'o' stdout and 'e' stderr as they come, then 'x' the status
+//           as a u32
+//
+// When a client hangs up, its running request is sent SIGHUP.
+const size_t frame_header = 1 + sizeof(uint32_t);
+
+// A request's output is left in its pipes while this much is still
+// waiting to go to a slow client.
+const size_t server_backlog = 1 << 20;
+
+void append_frame(string &buf, char type, string_view data) {
+  uint32_t len = data.size();
+  buf += type;
+  buf.append(reinterpret_cast<const char *>(&len), sizeof len);
+  buf += data;
+}
+
+void append_status(string &buf, uint32_t code) {
+  append_frame(buf, 'x',
+               string_view(reinterpret_cast<const char *>(&code), sizeof code));
+}
+
+// Takes the first whole frame off `buf`; false if there isn't one yet.
+bool take_frame(string &buf, char &type, string &data) {
+  if (buf.size() < frame_header)
+    return false;
+  uint32_t len = load_u32(buf.data() + 1);
+  if (buf.size() - frame_header < len)
+    return false;
+  type = buf[0];
+  data.assign(buf, frame_header, len);
+  buf.erase(0, frame_header + len);
+  return true;
+}
+
+bool socket_address(const char *path, struct sockaddr_un &addr) {
+  addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    cerr << "fero: " << path << ": socket path too long\n";
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+  return true;
+}
+
+int connect_socket(const struct sockaddr_un &addr) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd != -1 &&
+      connect(fd, reinterpret_cast<const struct sockaddr *>(&addr),
+              sizeof addr) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+struct ServerConn {
+  int fd = -1;      // -1 once the client has hung up
+  bool eof = false; // it has sent all it is going to
+  string in, out;   // bytes received and frames not yet sent
+  string request;   // taken from `in` and waiting for a slot
+  bool queued = false;
+
+  pid_t pid = 0;               // the request running, if any
+  int pipes[2] = {-1, -1};     // its stdout and stderr
+  bool reaped = false;
+  int code = 0;
+};
+
+// Parses a one-line request into the server's own cache before the fork,
+// so the child finds it there and so does every later request for the
+// same line. A syntax error is left for the child to report.
+void warm_parse_cache(string_view request) {
+  if (request.find('\n') != string_view::npos)
+    return;
+  streambuf *buf = cerr.rdbuf(nullptr);
+  parse_cached(request);
+  cerr.rdbuf(buf);
+  cerr.clear();
+}
+
+void start_request(ServerConn &c, list<ServerConn> &conns, int listen_fd) {
+  c.queued = false;
+  warm_parse_cache(c.request);
+  refresh_path_index();
+  int out_pipe[2], err_pipe[2];
+  if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+    append_frame(c.out, 'e', "fero: pipe: " + string(strerror(errno)) + "\n");
+    append_status(c.out, 1);
+    return;
+  }
+  if (pipe2(err_pipe, O_CLOEXEC) != 0) {
+    append_frame(c.out, 'e', "fero: pipe: " + string(strerror(errno)) + "\n");
+    append_status(c.out, 1);
+    close(out_pipe[0]);
+    close(out_pipe[1]);
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Its own process group, so a hang-up reaches everything it started.
+    setpgid(0, 0);
+    int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    dup2(null, STDIN_FILENO);
+    dup2(out_pipe[1], STDOUT_FILENO);
+    dup2(err_pipe[1], STDERR_FILENO);
+    close(listen_fd);
+    for (auto &other : conns) {
+      for (int fd : {other.fd, other.pipes[0], other.pipes[1]})
+        if (fd != -1)
+          close(fd);
+    }
+    enter_subshell();
+    LineSource src;
+    src.map = c.request.data();
+    src.size = c.request.size();
+    int status = run_lines(src);
+    cout.flush();
+    _exit(status);
+  }
+  close(out_pipe[1]);
+  close(err_pipe[1]);
+  c.request.clear();
+  if (pid < 0) {
+    append_frame(c.out, 'e', "fero: fork: " + string(strerror(errno)) + "\n");
+    append_status(c.out, 1);
+    close(out_pipe[0]);
+    close(err_pipe[0]);
+    return;
+  }
+  setpgid(pid, pid);
+  c.pid = pid;
+  c.reaped = false;
+  c.pipes[0] = out_pipe[0];
+  c.pipes[1] = err_pipe[0];
+  fcntl(c.pipes[0], F_SETFL, O_NONBLOCK);
+  fcntl(c.pipes[1], F_SETFL, O_NONBLOCK);
+}
+
+void server_hangup(ServerConn &c) {
+  close(c.fd);
+  c.fd = -1;
+  c.in.clear();
+  c.out.clear();
+  if (c.pid > 0 && !c.reaped)
+    kill(-c.pid, SIGHUP);
+}
+
+// Sends what it can of `c.out` without blocking.
+void server_flush(ServerConn &c) {
+  while (c.fd != -1 && !c.out.empty()) {
+    ssize_t n =
+        send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n >= 0) {
+      c.out.erase(0, n);
+    } else if (errno != EINTR) {
+      if (errno != EAGAIN)
+        server_hangup(c);
+      return;
+    }
+  }
+}
+
+int run_server(const char *path, size_t max_jobs) {
+  struct sockaddr_un addr;
+  if (!socket_address(path, addr))
+    return 1;
+  int listen_fd =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  auto bind_socket = [&] {
+    return bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr),
+                sizeof addr) == 0;
+  };
+  bool bound = listen_fd != -1 && bind_socket();
+  // A socket left behind by a server that is gone is taken over.
+  if (!bound && errno == EADDRINUSE) {
+    int live = connect_socket(addr);
+    if (live != -1) {
+      close(live);
+      cerr << "fero: " << path << ": a server is already listening\n";
+      return 1;
+    }
+    unlink(path);
+    bound = bind_socket();
+  }
+  if (!bound || listen(listen_fd, SOMAXCONN) != 0) {
+    perror(("fero: " + string(path)).c_str());
+    return 1;
+  }
+
+  // Warm from the first request on.
+  init_path_watcher();
+  if (path_watcher)
+    adopt_path_index(true);
+  else
+    refresh_path_index();
+
+  list<ServerConn> conns;
+  list<ServerConn *> waiting;
+  size_t running = 0;
+  vector<struct pollfd> pfds;
+  vector<pair<ServerConn *, int>> owners; // and which pipe, or -1
+  while (true) {
+    while (running < max_jobs && !waiting.empty()) {
+      ServerConn &c = *waiting.front();
+      waiting.pop_front();
+      start_request(c, conns, listen_fd);
+      if (c.pid > 0)
+        running++;
+      server_flush(c);
+    }
+
+    pfds.assign({{listen_fd, POLLIN, 0}, {sigchld_pipe[0], POLLIN, 0}});
+    owners.assign(2, {nullptr, -1});
+    for (auto &c : conns) {
+      if (c.fd != -1) {
+        short events = 0;
+        // A request bigger than the backlog still has to come in whole.
+        if (!c.eof && (c.in.size() < server_backlog || c.pid == 0))
+          events |= POLLIN;
+        if (!c.out.empty())
+          events |= POLLOUT;
+        pfds.push_back({c.fd, events, 0});
+        owners.push_back({&c, -1});
+      }
+      for (int stream = 0; stream < 2; stream++) {
+        if (c.pipes[stream] != -1 && c.out.size() < server_backlog) {
+          pfds.push_back({c.pipes[stream], POLLIN, 0});
+          owners.push_back({&c, stream});
+        }
+      }
+    }
+    if (poll(pfds.data(), pfds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("fero: poll");
+      return 1;
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      int fd;
+      while ((fd = accept4(listen_fd, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+        conns.emplace_back().fd = fd;
+    }
+    if (pfds[1].revents & POLLIN) {
+      char drain[64];
+      while (read(sigchld_pipe[0], drain, sizeof drain) > 0)
+        ;
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (auto &c : conns) {
+          if (c.pid == pid) {
+            c.reaped = true;
+            c.code = exit_code(status);
+          }
+        }
+      }
+    }
+    char buf[1 << 16];
+    for (size_t i = 2; i < pfds.size(); i++) {
+      if (!pfds[i].revents)
+        continue;
+      ServerConn &c = *owners[i].first;
+      int stream = owners[i].second;
+      if (stream >= 0) {
+        ssize_t n = read(c.pipes[stream], buf, sizeof buf);
+        if (n > 0 && c.fd != -1)
+          append_frame(c.out, stream ? 'e' : 'o', string_view(buf, n));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+          close(c.pipes[stream]);
+          c.pipes[stream] = -1;
+        }
+        continue;
+      }
+      if (c.fd == -1)
+        continue;
+      if (pfds[i].revents & (POLLHUP | POLLERR)) {
+        server_hangup(c);
+        continue;
+      }
+      if (pfds[i].revents & POLLIN) {
+        ssize_t n = recv(c.fd, buf, sizeof buf, 0);
+        if (n > 0)
+          c.in.append(buf, n);
+        else if (n == 0)
+          c.eof = true;
+        else if (errno != EAGAIN && errno != EINTR)
+          server_hangup(c);
+      }
+    }
+
+    for (auto it = conns.begin(); it != conns.end();) {
+      ServerConn &c = *it;
+      if (c.pid > 0 && c.reaped && c.pipes[0] == -1 && c.pipes[1] == -1) {
+        append_status(c.out, c.code);
+        c.pid = 0;
+        running--;
+      }
+      char type;
+      if (c.fd != -1 && c.pid == 0 && !c.queued &&
+          take_frame(c.in, type, c.request)) {
+        if (type == 'r') {
+          c.queued = true;
+          waiting.push_back(&c);
+        } else {
+          server_hangup(c);
+        }
+      }
+      server_flush(c);
+      bool idle = c.pid == 0 && !c.queued && c.out.empty();
+      if (c.fd != -1 && c.eof && idle) {
+        close(c.fd);
+        c.fd = -1;
+      }
+      if (c.fd == -1 && c.pid == 0) {
+        if (c.queued)
+          waiting.remove(&c);
+        it = conns.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+// Sends one request and relays what comes back; exits with its status.
+int run_client(const char *path, const string &request) {
+  struct sockaddr_un addr;
+  if (!socket_address(path, addr))
+    return 1;
+  int fd = connect_socket(addr);
+  string buf;
+  append_frame(buf, 'r', request);
+  if (fd == -1 || !write_all(fd, buf.data(), buf.size())) {
+    perror(("fero: " + string(path)).c_str());
+    return 1;
+  }
+  buf.clear();
+  char type;
+  string data;
+  char chunk[1 << 16];
+  while (true) {
+    while (take_frame(buf, type, data)) {
+      if (type == 'x' && data.size() == sizeof(uint32_t))
+        return load_u32(data.data());
+      write_all(type == 'e' ? STDERR_FILENO : STDOUT_FILENO, data.data(),
+                data.size());
+    }
+    ssize_t n = read(fd, chunk, sizeof chunk);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      cerr << "fero: " << path << ": server closed the connection\n";
+      return 1;
+    }
+    buf.append(chunk, n);
+  }
+}
+
+#ifndef FERO_NO_MAIN
+int main(int argc, char **argv) {
+  if (argc > 2 && strcmp(argv[1], "--client") == 0) {
+    string request;
+    for (int i = 3; i < argc; i++)
+      request += (i > 3 ? " " : "") + string(argv[i]);
+    if (argc == 3) {
+      char buf[1 << 16];
+      ssize_t n;
+      while ((n = read(STDIN_FILENO, buf, sizeof buf)) > 0)
+        request.append(buf, n);
+    }
+    return run_client(argv[2], request);
+  }
+  if (const char *backend = getenv("FERO_SPAWN")) {
+    if (!parse_spawn_backend(backend, spawn_backend))
+      cerr << "fero: unknown FERO_SPAWN backend: " << backend << "\n";
+  }
+  if (const char *file = getenv("FERO_STATS")) {
+    stats_file = file;
+    atexit(write_stats_file);
+  }
+  init_vars();
+  init_sigchld();
+  init_pwd();
+  // A script does no job control: what it runs stays in fero's process
+  // group, as in a subshell, so it can read the terminal and Ctrl-C
+  // reaches it.
+  if (argc > 1 || !isatty(STDIN_FILENO))
+    subshell_pgid = getpgrp();
+  if (argc > 2 && strcmp(argv[1], "--server") == 0) {
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc == 5 && strcmp(argv[3], "-j") == 0)
+      max_jobs = atol(argv[4]);
+    else if (argc != 3)
+      max_jobs = 0;
+    if (max_jobs < 1) {
+      cerr << "[Usage]: fero --server <socket> [-j N]\n";
+      return 2;
+    }
+    return run_server(argv[2], max_jobs);
+  }
+  if (argc > 1) {
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      perror(("fero: " + string(argv[1])).c_str());
+      return 127;
+    }
+    int status = run_script(fd);
+    close(fd);
+    return status;
+  }
+  if (!isatty(STDIN_FILENO))
+    return run_script(STDIN_FILENO);
+
+  init_job_control();
+  init_history();
+  init_path_watcher();
+  init_prompt();
+  init_completion();
+  request_history_index();
+  cout << "\033[2J\033[H" << flush;
+  while (true) {
+    notify_jobs();
+    draw_prompt();
+    refresh_path_index();
+    string input = read_input();
+    if (input.empty())
+      continue;
+    while (heredoc_open(input)) {
+      prompt_above = false;
+      cout << "> " << flush;
+      input += '\n';
+      input += read_input();
+    }
+    history_add(input);
+    run_line(input);
   }
 
   return 0;
 }
+#endif
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Script-mode regression tests: runs each tests/NAME.fero with the given
+# fero binary in an empty scratch directory and compares what it prints,
+# stdout and stderr together, and its exit status with tests/NAME.out.
+#
+#   make check
+#   tests/run.sh ./main [name...]
+
+fero=$(realpath "${1:-./main}")
+[ $# -gt 0 ] && shift
+tests=$(cd "$(dirname "$0")" && pwd)
+[ $# -eq 0 ] && set -- $(cd "$tests" && ls *.fero | sed 's/\.fero$//')
+
+failed=0
+for name; do
+  scratch=$(mktemp -d /tmp/fero-test.XXXXXX)
+  (cd "$scratch" && HOME="$scratch" "$fero" "$tests/$name.fero" \
+     < /dev/null > "$scratch.out" 2>&1; echo "status $?" >> "$scratch.out")
+  if diff -u "$tests/$name.out" "$scratch.out" > "$scratch.diff"; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"
+    cat "$scratch.diff"
+    failed=$((failed + 1))
+  fi
+  rm -rf "$scratch" "$scratch.out" "$scratch.diff"
+done
+[ $failed -eq 0 ] || { echo "$failed failed"; exit 1; }